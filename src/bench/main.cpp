@@ -0,0 +1,1967 @@
+#include <async.h>
+#include <async_expr.h>
+#include <async_file.h>
+#include <async_io.h>
+#include <async_loop.h>
+#include <async_once.h>
+#include <async_result.h>
+#include <async_timer.h>
+#include <either_parallel.h>
+#include <either_simd.h>
+#include <either_vector.h>
+#include <thread_pool.h>
+#include <when_all.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace async;
+
+//------------------------------------------------------------------------------
+// Count every heap allocation made by the program, and the bytes asked for
+
+static std::atomic<long> s_allocCount{0};
+static std::atomic<long> s_allocBytes{0};
+
+void* operator new(std::size_t n)
+{
+  ++s_allocCount;
+  s_allocBytes += static_cast<long>(n);
+  if (void* p = std::malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t n)
+{
+  return operator new(n);
+}
+
+// Once the replacements are inlined, g++ sees memory from operator new
+// reaching free() and warns of a mismatch; but these operator news come from
+// malloc, so it isn't one.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+//------------------------------------------------------------------------------
+// A registry of microbenchmarks, after Google Benchmark (and with the same
+// names, so that moving to the real thing is mechanical):
+//
+//   void benchFoo(benchmark::State& state)
+//   {
+//     for (auto _ : state)
+//       benchmark::DoNotOptimize(foo(state.range(0)));
+//   }
+//   BENCHMARK(benchFoo)->Range(1, 64);
+//
+// Each benchmark runs for enough iterations to take at least the minimum time
+// (or for a fixed number, given by Iterations), and reports ns/op, allocs/op
+// and bytes/op, with items/s and MB/s if it says how much it processed, and
+// any counters it sets. Only the loop is timed, so set-up before it and
+// waiting or tearing down after it aren't. Running the program with an
+// argument runs only the registered benchmarks whose names contain it.
+
+namespace benchmark
+{
+  class State
+  {
+  public:
+    State(std::size_t iterations, const std::vector<long>& args)
+      : m_iterations(iterations), m_args(args)
+    {}
+
+    // what the loop variable holds: nothing, but it isn't trivial, so an
+    // unused loop variable doesn't draw a warning
+    struct Value
+    {
+      ~Value() {}
+    };
+
+    // the loop stops the clock when it runs out
+    struct Iterator
+    {
+      std::size_t remaining;
+      State* state;
+      Value operator*() const { return Value(); }
+      Iterator& operator++() { --remaining; return *this; }
+      bool operator!=(const Iterator&) const
+      {
+        if (remaining != 0)
+          return true;
+        state->finish();
+        return false;
+      }
+    };
+
+    // the clock and the allocation counters start when the loop starts
+    Iterator begin()
+    {
+      m_allocs = s_allocCount;
+      m_bytes = s_allocBytes;
+      m_start = chrono::steady_clock::now();
+      return Iterator{m_error.empty() ? m_iterations : 0, this};
+    }
+
+    Iterator end()
+    {
+      return Iterator{0, this};
+    }
+
+    long range(std::size_t i = 0) const { return m_args[i]; }
+    std::size_t iterations() const { return m_iterations; }
+
+    // Say how much the loop got through in all, for a rate per second
+    void SetItemsProcessed(long n) { m_items = n; }
+    void SetBytesProcessed(long n) { m_processed = n; }
+
+    // Don't run the loop (called before it), and report why
+    void SkipWithError(const std::string& why) { m_error = why; }
+
+    // Anything else worth reporting, reported as it is
+    std::map<std::string, double> counters;
+
+    void finish()
+    {
+      if (m_finished)
+        return;
+      m_finished = true;
+      auto end = chrono::steady_clock::now();
+      m_ns = chrono::duration_cast<chrono::nanoseconds>(end - m_start).count();
+      m_allocs = s_allocCount - m_allocs;
+      m_bytes = s_allocBytes - m_bytes;
+    }
+
+    double nsPerOp() const { return static_cast<double>(m_ns) / m_iterations; }
+    double allocsPerOp() const { return static_cast<double>(m_allocs) / m_iterations; }
+    double bytesPerOp() const { return static_cast<double>(m_bytes) / m_iterations; }
+    double itemsPerSecond() const { return static_cast<double>(m_items) * 1e9 / m_ns; }
+    double mbPerSecond() const { return static_cast<double>(m_processed) * 1e9 / m_ns / (1 << 20); }
+    long items() const { return m_items; }
+    long processed() const { return m_processed; }
+    long ns() const { return m_ns; }
+    const std::string& error() const { return m_error; }
+
+  private:
+    std::size_t m_iterations;
+    const std::vector<long>& m_args;
+    chrono::steady_clock::time_point m_start;
+    bool m_finished = false;
+    long m_ns = 0;
+    long m_allocs = 0;
+    long m_bytes = 0;
+    long m_items = 0;
+    long m_processed = 0;
+    std::string m_error;
+  };
+
+  // Keep a value (and whatever it points to) alive as far as the optimizer
+  // knows
+  template <typename T>
+  inline void DoNotOptimize(const T& value)
+  {
+    asm volatile("" : : "r,m"(value) : "memory");
+  }
+
+  class Benchmark
+  {
+  public:
+    Benchmark(const char* name, void (*f)(State&))
+      : m_name(name), m_f(f)
+    {}
+
+    Benchmark* Arg(long a)
+    {
+      m_args.push_back(a);
+      return this;
+    }
+
+    // Run exactly n iterations, rather than enough to take the minimum time
+    Benchmark* Iterations(std::size_t n)
+    {
+      m_iterations = n;
+      return this;
+    }
+
+    // lo, then powers of 2 up to hi
+    Benchmark* Range(long lo, long hi)
+    {
+      m_args.push_back(lo);
+      for (long a = 1; a < hi; a *= 2)
+        if (a > lo)
+          m_args.push_back(a);
+      if (hi > lo)
+        m_args.push_back(hi);
+      return this;
+    }
+
+    void run(const char* filter, double minSeconds) const
+    {
+      if (m_args.empty())
+        runOne(m_name, {}, filter, minSeconds);
+      for (long a : m_args)
+        runOne(m_name + "/" + to_string(a), { a }, filter, minSeconds);
+    }
+
+  private:
+    void runOne(const std::string& name, const std::vector<long>& args,
+                const char* filter, double minSeconds) const
+    {
+      if (filter && name.find(filter) == std::string::npos)
+        return;
+
+      // grow the iteration count until a run takes long enough
+      const long minNs = static_cast<long>(minSeconds * 1e9);
+      for (std::size_t n = m_iterations ? m_iterations : 1; ; )
+      {
+        State state(n, args);
+        m_f(state);
+        state.finish();
+        if (!state.error().empty())
+        {
+          cout.width(40);
+          cout << std::left << name << std::right
+               << " skipped: " << state.error() << endl;
+          return;
+        }
+        if (m_iterations || state.ns() >= minNs || n >= 1000000000)
+        {
+          report(name, state);
+          return;
+        }
+        double scale = state.ns() > 0
+          ? 1.4 * static_cast<double>(minNs) / static_cast<double>(state.ns())
+          : 10.0;
+        n = static_cast<std::size_t>(static_cast<double>(n) * std::min(std::max(scale, 1.2), 10.0)) + 1;
+      }
+    }
+
+    static void report(const std::string& name, const State& state)
+    {
+      cout.setf(std::ios::fixed);
+      cout.precision(1);
+      cout.width(40);
+      cout << std::left << name << std::right;
+      cout.width(12);
+      cout << state.nsPerOp() << " ns/op";
+      cout.precision(2);
+      cout.width(12);
+      cout << state.allocsPerOp() << " allocs/op";
+      cout.precision(0);
+      cout.width(12);
+      cout << state.bytesPerOp() << " bytes/op";
+      cout.width(12);
+      cout << state.iterations() << " iterations";
+      cout.precision(1);
+      if (state.items())
+        cout << "  " << state.itemsPerSecond() << " items/s";
+      if (state.processed())
+        cout << "  " << state.mbPerSecond() << " MB/s";
+      for (const auto& c : state.counters)
+        cout << "  " << c.first << "=" << c.second;
+      cout << endl;
+      cout.unsetf(std::ios::fixed);
+      cout.precision(6);
+    }
+
+    std::string m_name;
+    void (*m_f)(State&);
+    std::vector<long> m_args;
+    std::size_t m_iterations = 0;
+  };
+
+  inline std::vector<std::unique_ptr<Benchmark>>& registry()
+  {
+    static std::vector<std::unique_ptr<Benchmark>> r;
+    return r;
+  }
+
+  inline Benchmark* registerBenchmark(const char* name, void (*f)(State&))
+  {
+    registry().push_back(std::make_unique<Benchmark>(name, f));
+    return registry().back().get();
+  }
+
+  inline void runBenchmarks(const char* filter, double minSeconds = 0.2)
+  {
+    for (const auto& b : registry())
+      b->run(filter, minSeconds);
+  }
+}
+
+#define BENCHMARK_CONCAT2(a, b) a##b
+#define BENCHMARK_CONCAT(a, b) BENCHMARK_CONCAT2(a, b)
+// variadic, so that a template instance with several arguments can be named
+#define BENCHMARK(...) \
+  static ::benchmark::Benchmark* BENCHMARK_CONCAT(s_benchmark, __LINE__) \
+    __attribute__((unused)) = ::benchmark::registerBenchmark(#__VA_ARGS__, __VA_ARGS__)
+
+//------------------------------------------------------------------------------
+// A composed chain of ten steps
+
+Async<int> AsyncLength(const string& s)
+{
+  int n = static_cast<int>(s.size());
+  return [n] (ContinuationT<int> f) { f(n); };
+}
+
+Async<int> AsyncDouble(int i)
+{
+  return [i] (ContinuationT<int> f) { f(i * 2); };
+}
+
+Async<void> AsyncNothing()
+{
+  return [] (ContinuationT<void> f) { f(); };
+}
+
+Async<int> AsyncOne()
+{
+  return [] (ContinuationT<int> f) { f(1); };
+}
+
+void benchChainOfTen(benchmark::State& state)
+{
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = fmap([] (int i) { return to_string(i); },
+                  pure(string("a reasonably long string payload")) >= AsyncLength);
+    auto b = fmap([] (string s) { return s + "!"; }, std::move(a)) >= AsyncLength;
+    auto c = (std::move(b) >= AsyncDouble >= AsyncDouble) > AsyncNothing;
+    auto d = (std::move(c) > AsyncOne) >= AsyncDouble;
+    std::move(d)([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchChainOfTen);
+
+//------------------------------------------------------------------------------
+// The same steps as statically-typed AsyncExprs, and written by hand
+
+auto ExprDouble(int i)
+{
+  return async::expr::pure(i * 2);
+}
+
+auto ExprAddOne(int i)
+{
+  return async::expr::pure(i + 1);
+}
+
+void benchErasedBindTwice(benchmark::State& state)
+{
+  volatile int seed = 1;
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = pure(static_cast<int>(seed)) >= AsyncDouble >= AsyncDouble;
+    std::move(a)([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchErasedBindTwice);
+
+void benchExprBindTwice(benchmark::State& state)
+{
+  volatile int seed = 1;
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = async::expr::pure(static_cast<int>(seed)) >= ExprDouble >= ExprAddOne;
+    a([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchExprBindTwice);
+
+void benchHandWrittenBindTwice(benchmark::State& state)
+{
+  volatile int seed = 1;
+  int result = 0;
+  for (auto _ : state)
+    result += static_cast<int>(seed) * 2 + 1;
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchHandWrittenBindTwice);
+
+void benchExprFmapFour(benchmark::State& state)
+{
+  namespace ex = async::expr;
+  volatile int seed = 1;
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto f = [] (int i) { return i + 1; };
+    auto a = ex::fmap(f, ex::fmap(f, ex::fmap(f, ex::fmap(f, ex::pure(static_cast<int>(seed))))));
+    a([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchExprFmapFour);
+
+//------------------------------------------------------------------------------
+// apply rendezvous, with the two sides completing on different threads
+
+// An Async<int> which hands its continuation to a worker thread to complete
+struct Completer
+{
+  Completer()
+    : m_thread([this] { run(); })
+  {}
+
+  ~Completer()
+  {
+    m_quit = true;
+    m_thread.join();
+  }
+
+  Async<int> async()
+  {
+    return [this] (ContinuationT<int> cont) {
+      m_cont = std::move(cont);
+      m_ready.store(true, std::memory_order_release);
+    };
+  }
+
+  void run()
+  {
+    while (!m_quit)
+    {
+      if (!m_ready.load(std::memory_order_acquire))
+      {
+        std::this_thread::yield();
+        continue;
+      }
+      m_ready.store(false, std::memory_order_relaxed);
+      ContinuationT<int> cont = std::move(m_cont);
+      cont(1);
+    }
+  }
+
+  ContinuationT<int> m_cont;
+  std::atomic<bool> m_ready{false};
+  std::atomic<bool> m_quit{false};
+  std::thread m_thread;
+};
+
+int add2(int x, int y)
+{
+  return x + y;
+}
+
+void benchApplyTwoThreads(benchmark::State& state)
+{
+  Completer left;
+  Completer right;
+  std::atomic<int> done{0};
+  for (auto _ : state)
+  {
+    auto a = async::apply(fmap(add2, left.async()), right.async());
+    std::move(a)([&done] (int) { done.fetch_add(1, std::memory_order_release); });
+    while (done.load(std::memory_order_acquire) == 0)
+      std::this_thread::yield();
+    done = 0;
+  }
+}
+BENCHMARK(benchApplyTwoThreads);
+
+//------------------------------------------------------------------------------
+// Returning an Either by value: trivial alternatives can travel in registers,
+// a non-trivial one forces the result through memory
+
+// An int with a user-provided copy constructor
+struct NonTrivialInt
+{
+  NonTrivialInt(int i) : value(i) {}
+  NonTrivialInt(const NonTrivialInt& other) : value(other.value) {}
+  int value;
+};
+
+__attribute__((noinline)) Either<int, int> checkedHalf(int i)
+{
+  if (i & 1)
+    return Either<int, int>(i, true);
+  return Either<int, int>(i / 2);
+}
+
+__attribute__((noinline)) Either<int, NonTrivialInt> checkedHalfNonTrivial(int i)
+{
+  if (i & 1)
+    return Either<int, NonTrivialInt>(i, true);
+  return Either<int, NonTrivialInt>(NonTrivialInt(i / 2));
+}
+
+void benchReturnEither(benchmark::State& state)
+{
+  long result = 0;
+  int i = 0;
+  for (auto _ : state)
+  {
+    auto e = checkedHalf(++i);
+    result += e.isRight() ? e.m_right : -e.m_left;
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchReturnEither);
+
+void benchReturnEitherNonTrivial(benchmark::State& state)
+{
+  long result = 0;
+  int i = 0;
+  for (auto _ : state)
+  {
+    auto e = checkedHalfNonTrivial(++i);
+    result += e.isRight() ? e.m_right.value : -e.m_left;
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchReturnEitherNonTrivial);
+
+//------------------------------------------------------------------------------
+// Scans over a million results, one in ten failed: vector<Either> against
+// EitherVector. An op is a pass over all of them.
+
+struct EitherVectorData
+{
+  static const int n = 1000000;
+
+  EitherVectorData()
+  {
+    aos.reserve(n);
+    soa.reserve(n);
+    for (int i = 0; i < n; ++i)
+    {
+      // a cheap scramble, so that the failures don't fall in a pattern
+      if ((i * 2654435761u) % 10 == 0)
+      {
+        aos.push_back(Either<int, double>(i, true));
+        soa.emplace_left(i);
+      }
+      else
+      {
+        aos.push_back(Either<int, double>(i * 0.5));
+        soa.emplace_right(i * 0.5);
+      }
+    }
+  }
+
+  // made on first use, and shared by the benchmarks
+  static const EitherVectorData& get()
+  {
+    static EitherVectorData data;
+    return data;
+  }
+
+  std::vector<Either<int, double>> aos;
+  EitherVector<int, double> soa;
+};
+
+void benchCountLeftVector(benchmark::State& state)
+{
+  const auto& aos = EitherVectorData::get().aos;
+  long count = 0;
+  for (auto _ : state)
+    for (const auto& e : aos)
+      count += !e.isRight();
+  benchmark::DoNotOptimize(count);
+}
+BENCHMARK(benchCountLeftVector);
+
+// A scan of the tag bitmap, a popcount per 64 elements, against the scan of
+// the Eithers above. (countLeft() itself is just the size of the lefts, so
+// there's nothing to time.)
+void benchCountLeftEitherVector(benchmark::State& state)
+{
+  const auto& soa = EitherVectorData::get().soa;
+  long count = 0;
+  for (auto _ : state)
+  {
+    std::size_t rights = 0;
+    for (std::uint64_t w : soa.tags())
+      rights += static_cast<std::size_t>(__builtin_popcountll(w));
+    count += static_cast<long>(soa.size() - rights);
+  }
+  benchmark::DoNotOptimize(count);
+}
+BENCHMARK(benchCountLeftEitherVector);
+
+void benchSumRightsVector(benchmark::State& state)
+{
+  const auto& aos = EitherVectorData::get().aos;
+  double sum = 0;
+  for (auto _ : state)
+    for (const auto& e : aos)
+      if (e.isRight())
+        sum += e.m_right;
+  benchmark::DoNotOptimize(sum);
+}
+BENCHMARK(benchSumRightsVector);
+
+void benchSumRightsEitherVector(benchmark::State& state)
+{
+  const auto& soa = EitherVectorData::get().soa;
+  double sum = 0;
+  for (auto _ : state)
+    for (double d : soa.rights())
+      sum += d;
+  benchmark::DoNotOptimize(sum);
+}
+BENCHMARK(benchSumRightsEitherVector);
+
+void benchIterateEitherVector(benchmark::State& state)
+{
+  const auto& soa = EitherVectorData::get().soa;
+  double sum = 0;
+  for (auto _ : state)
+    for (auto e : soa)
+      if (e.isRight())
+        sum += e.right();
+  benchmark::DoNotOptimize(sum);
+}
+BENCHMARK(benchIterateEitherVector);
+
+void benchFmapVector(benchmark::State& state)
+{
+  const auto& aos = EitherVectorData::get().aos;
+  std::size_t count = 0;
+  for (auto _ : state)
+  {
+    std::vector<Either<int, float>> out;
+    out.reserve(aos.size());
+    for (const auto& e : aos)
+      out.push_back(either::fmap([] (double d) { return static_cast<float>(d); }, e));
+    count += out.size();
+  }
+  benchmark::DoNotOptimize(count);
+}
+BENCHMARK(benchFmapVector);
+
+void benchFmapEitherVector(benchmark::State& state)
+{
+  const auto& soa = EitherVectorData::get().soa;
+  std::size_t count = 0;
+  for (auto _ : state)
+  {
+    auto out = soa.fmap([] (double d) { return static_cast<float>(d); });
+    count += out.size();
+  }
+  benchmark::DoNotOptimize(count);
+}
+BENCHMARK(benchFmapEitherVector);
+
+//------------------------------------------------------------------------------
+// A numeric validation stage over a million results, half of them (at random)
+// failed: a per-element either::fmap against the vectorized bulk functions. An
+// op is a pass over all of them.
+
+enum ErrCode { NOT_VALIDATED, OUT_OF_RANGE };
+
+using either::simd::Isa;
+
+struct EitherSimdData
+{
+  static const int n = 1000000;
+
+  EitherSimdData()
+  {
+    in.reserve(n);
+    std::uint32_t x = 12345;
+    for (int i = 0; i < n; ++i)
+    {
+      x = x * 1664525 + 1013904223;
+      if (x >> 31)
+        in.push_back(Either<ErrCode, float>(OUT_OF_RANGE, true));
+      else
+        in.push_back(Either<ErrCode, float>(static_cast<float>(i)));
+    }
+  }
+
+  static const EitherSimdData& get()
+  {
+    static EitherSimdData data;
+    return data;
+  }
+
+  std::vector<Either<ErrCode, float>> in;
+};
+
+void benchFmapPerElement(benchmark::State& state)
+{
+  const auto& in = EitherSimdData::get().in;
+  auto out = in;
+  float sum = 0;
+  for (auto _ : state)
+  {
+    auto f = [] (float v) { return v * 0.5f + 1.0f; };
+    for (std::size_t i = 0; i < in.size(); ++i)
+      out[i] = either::fmap(f, in[i]);
+    sum += out[in.size() / 2].isRight() ? out[in.size() / 2].m_right : 0;
+  }
+  benchmark::DoNotOptimize(sum);
+}
+BENCHMARK(benchFmapPerElement);
+
+template <Isa isa>
+void benchFmapN(benchmark::State& state)
+{
+  if (isa > either::simd::detectIsa())
+    state.SkipWithError("not supported on this CPU");
+  const auto& in = EitherSimdData::get().in;
+  auto out = in;
+  float sum = 0;
+  for (auto _ : state)
+  {
+    either::simd::fmap_n(isa, [] (auto v) { return v * 0.5f + 1.0f; },
+                         in.data(), in.size(), out.data());
+    sum += out[in.size() / 2].isRight() ? out[in.size() / 2].m_right : 0;
+  }
+  benchmark::DoNotOptimize(sum);
+}
+BENCHMARK(benchFmapN<Isa::SCALAR>);
+BENCHMARK(benchFmapN<Isa::SSE4>);
+BENCHMARK(benchFmapN<Isa::AVX2>);
+
+void benchPartitionPerElement(benchmark::State& state)
+{
+  const auto& in = EitherSimdData::get().in;
+  std::vector<ErrCode> lefts(in.size());
+  std::vector<float> rights(in.size());
+  float sum = 0;
+  for (auto _ : state)
+  {
+    std::size_t nl = 0;
+    std::size_t nr = 0;
+    for (const auto& e : in)
+    {
+      if (e.isRight())
+        rights[nr++] = e.m_right;
+      else
+        lefts[nl++] = e.m_left;
+    }
+    sum += rights[nr / 2];
+  }
+  benchmark::DoNotOptimize(sum);
+}
+BENCHMARK(benchPartitionPerElement);
+
+template <Isa isa>
+void benchPartitionN(benchmark::State& state)
+{
+  if (isa > either::simd::detectIsa())
+    state.SkipWithError("not supported on this CPU");
+  const auto& in = EitherSimdData::get().in;
+  std::vector<ErrCode> lefts(in.size());
+  std::vector<float> rights(in.size());
+  float sum = 0;
+  for (auto _ : state)
+  {
+    auto counts = either::simd::partition_n(
+        isa, in.data(), in.size(), lefts.data(), rights.data());
+    sum += rights[counts.second / 2];
+  }
+  benchmark::DoNotOptimize(sum);
+}
+BENCHMARK(benchPartitionN<Isa::SCALAR>);
+BENCHMARK(benchPartitionN<Isa::SSE4>);
+BENCHMARK(benchPartitionN<Isa::AVX2>);
+
+//------------------------------------------------------------------------------
+// The error path of a five-stage chain of results: bindE against binds which
+// check for a Left by hand. The chains are built once, and only starting them
+// is timed. (The steps are plain functions, so a chain can be started again
+// and again.)
+
+AsyncResult<int, int> ResultStep(int i)
+{
+  return [i] (ContinuationT<Either<int, int>> f) { f(Either<int, int>(i + 1)); };
+}
+
+AsyncResult<int, int> HandWrappedStep(Either<int, int> e)
+{
+  if (!e.isRight())
+    return pure(Either<int, int>(e.m_left, true));
+  return ResultStep(e.m_right);
+}
+
+void benchBindHandWrappedError(benchmark::State& state)
+{
+  volatile int error = 1;
+  auto a = failE<int>(static_cast<int>(error))
+    >= HandWrappedStep >= HandWrappedStep >= HandWrappedStep
+    >= HandWrappedStep >= HandWrappedStep;
+  int result = 0;
+  for (auto _ : state)
+    a([&result] (const Either<int, int>& e) { result += e.m_left; });
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchBindHandWrappedError);
+
+void benchBindEError(benchmark::State& state)
+{
+  volatile int error = 1;
+  auto a = bindE(bindE(bindE(bindE(bindE(
+      failE<int>(static_cast<int>(error)),
+      ResultStep), ResultStep), ResultStep), ResultStep), ResultStep);
+  int result = 0;
+  for (auto _ : state)
+    a([&result] (const Either<int, int>& e) { result += e.m_left; });
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchBindEError);
+
+void benchBindESuccess(benchmark::State& state)
+{
+  volatile int seed = 1;
+  auto a = bindE(bindE(bindE(bindE(bindE(
+      pureE<int>(static_cast<int>(seed)),
+      ResultStep), ResultStep), ResultStep), ResultStep), ResultStep);
+  int result = 0;
+  for (auto _ : state)
+    a([&result] (const Either<int, int>& e) { result += e.m_right; });
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchBindESuccess);
+
+//------------------------------------------------------------------------------
+// scatter-gather: when_all against a balanced tree of &&
+
+template <int N>
+struct AndTree
+{
+  static auto make() { return AndTree<N / 2>::make() && AndTree<N / 2>::make(); }
+};
+
+template <>
+struct AndTree<1>
+{
+  static auto make() { return AsyncOne(); }
+};
+
+template <std::size_t... Is>
+auto whenAllOnes(std::index_sequence<Is...>)
+{
+  return when_all(((void)Is, AsyncOne())...);
+}
+
+template <int N>
+void benchAndTree(benchmark::State& state)
+{
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = AndTree<N>::make();
+    std::move(a)([&result] (const auto&) { ++result; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchAndTree<16>);
+BENCHMARK(benchAndTree<64>);
+
+template <int N>
+void benchWhenAll(benchmark::State& state)
+{
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = whenAllOnes(std::make_index_sequence<N>());
+    std::move(a)([&result] (const auto&) { ++result; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchWhenAll<16>);
+BENCHMARK(benchWhenAll<64>);
+
+void benchWhenAllVector(benchmark::State& state)
+{
+  const long n = state.range(0);
+  long result = 0;
+  for (auto _ : state)
+  {
+    std::vector<Async<int>> as;
+    as.reserve(n);
+    for (long i = 0; i < n; ++i)
+      as.push_back(pure(static_cast<int>(i)));
+    auto a = when_all(std::move(as));
+    std::move(a)([&result] (const std::vector<int>& v) { result += v.size(); });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchWhenAllVector)->Arg(1000);
+
+void benchWhenAllVectorViaPool(benchmark::State& state)
+{
+  const long n = state.range(0);
+  ThreadPool pool;
+  long result = 0;
+  for (auto _ : state)
+  {
+    std::vector<Async<int>> as;
+    as.reserve(n);
+    for (long i = 0; i < n; ++i)
+      as.push_back(via(pool, pure(static_cast<int>(i))));
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    auto a = when_all(std::move(as));
+    std::move(a)([&] (const std::vector<int>& v) {
+        std::lock_guard<std::mutex> g(m);
+        result += v.size();
+        done = true;
+        cv.notify_one();
+      });
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&done] { return done; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchWhenAllVectorViaPool)->Arg(1000);
+
+//------------------------------------------------------------------------------
+// traverse over 10M elements: sequential, and in parallel on 1 to N threads,
+// when every element is valid and when the first invalid one is a tenth of the
+// way in
+
+Either<int, int> ValidateNonNegative(int i)
+{
+  if (i < 0)
+    return Either<int, int>(i, true);
+  return Either<int, int>(i / 2);
+}
+
+struct TraverseData
+{
+  static const int n = 10000000;
+
+  TraverseData()
+    : valid(n)
+  {
+    for (int i = 0; i < n; ++i)
+      valid[i] = i;
+    invalid = valid;
+    invalid[n / 10] = -1;
+  }
+
+  static const TraverseData& get()
+  {
+    static TraverseData data;
+    return data;
+  }
+
+  std::vector<int> valid;
+  std::vector<int> invalid;
+};
+
+std::size_t traversed(const Either<int, std::vector<int>>& e)
+{
+  return e.isRight() ? e.m_right.size() : 1;
+}
+
+void benchTraverseValid(benchmark::State& state)
+{
+  const auto& data = TraverseData::get();
+  std::size_t result = 0;
+  for (auto _ : state)
+    result += traversed(either::traverse(data.valid, ValidateNonNegative));
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchTraverseValid);
+
+void benchTraverseInvalid(benchmark::State& state)
+{
+  const auto& data = TraverseData::get();
+  std::size_t result = 0;
+  for (auto _ : state)
+    result += traversed(either::traverse(data.invalid, ValidateNonNegative));
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchTraverseInvalid);
+
+// on as many threads as the argument
+void benchTraverseParallelValid(benchmark::State& state)
+{
+  const auto& data = TraverseData::get();
+  ThreadPool pool(static_cast<std::size_t>(state.range(0)));
+  std::size_t result = 0;
+  for (auto _ : state)
+    result += traversed(either::traverse(pool, data.valid, ValidateNonNegative));
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchTraverseParallelValid)
+  ->Range(1, static_cast<long>(ThreadPool::defaultSize()));
+
+void benchTraverseParallelInvalid(benchmark::State& state)
+{
+  const auto& data = TraverseData::get();
+  ThreadPool pool(static_cast<std::size_t>(state.range(0)));
+  std::size_t result = 0;
+  for (auto _ : state)
+    result += traversed(either::traverse(pool, data.invalid, ValidateNonNegative));
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchTraverseParallelInvalid)
+  ->Range(1, static_cast<long>(ThreadPool::defaultSize()));
+
+//------------------------------------------------------------------------------
+// concurrently fan-out on a thread pool, from 1 to N cores
+
+// Some CPU-bound work
+Async<long> AsyncWork()
+{
+  return [] (ContinuationT<long> f) {
+    long x = 0;
+    for (long i = 0; i < 100000; ++i)
+      x += (i * i) % 7;
+    f(x);
+  };
+}
+
+long add2l(long x, long y)
+{
+  return x + y;
+}
+
+// A binary tree of concurrently with 2^depth leaves, each started via the pool
+Async<long> fanOut(ThreadPool& pool, int depth)
+{
+  if (depth == 0)
+    return via(pool, AsyncWork());
+  return concurrently(fanOut(pool, depth - 1), fanOut(pool, depth - 1), add2l);
+}
+
+// on as many threads as the argument
+void benchFanOut(benchmark::State& state)
+{
+  const int depth = 6;
+  ThreadPool pool(static_cast<std::size_t>(state.range(0)));
+  for (auto _ : state)
+  {
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    auto a = fanOut(pool, depth);
+    std::move(a)([&] (long) {
+        std::lock_guard<std::mutex> g(m);
+        done = true;
+        cv.notify_one();
+      });
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&done] { return done; });
+  }
+}
+BENCHMARK(benchFanOut)->Range(1, static_cast<long>(ThreadPool::defaultSize()));
+
+//------------------------------------------------------------------------------
+// Microbenchmarks of the core combinators and of Either, registered with the
+// harness above. Chains are built at runtime, one step at a time, to the
+// depth given by the argument.
+
+Async<int> AsyncAddOne(int i)
+{
+  return [i] (ContinuationT<int> f) { f(i + 1); };
+}
+
+int AddOne(int i)
+{
+  return i + 1;
+}
+
+void benchPure(benchmark::State& state)
+{
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = pure(1);
+    std::move(a)([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchPure);
+
+void benchPureString(benchmark::State& state)
+{
+  std::size_t result = 0;
+  for (auto _ : state)
+  {
+    auto a = pure(string("a reasonably long string payload"));
+    std::move(a)([&result] (const string& s) { result += s.size(); });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchPureString);
+
+void benchFmapChain(benchmark::State& state)
+{
+  const long depth = state.range(0);
+  int result = 0;
+  for (auto _ : state)
+  {
+    Async<int> a = pure(0);
+    for (long i = 0; i < depth; ++i)
+      a = fmap(AddOne, std::move(a));
+    std::move(a)([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchFmapChain)->Range(1, 64);
+
+// Running a chain which is already built
+void benchFmapChainRun(benchmark::State& state)
+{
+  const long depth = state.range(0);
+  Async<int> a = pure(0);
+  for (long i = 0; i < depth; ++i)
+    a = fmap(AddOne, std::move(a));
+
+  int result = 0;
+  for (auto _ : state)
+    a([&result] (int i) { result += i; });
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchFmapChainRun)->Range(1, 64);
+
+void benchBindChain(benchmark::State& state)
+{
+  const long depth = state.range(0);
+  int result = 0;
+  for (auto _ : state)
+  {
+    Async<int> a = pure(0);
+    for (long i = 0; i < depth; ++i)
+      a = std::move(a) >= AsyncAddOne;
+    std::move(a)([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchBindChain)->Range(1, 64);
+
+void benchBindChainRun(benchmark::State& state)
+{
+  const long depth = state.range(0);
+  Async<int> a = pure(0);
+  for (long i = 0; i < depth; ++i)
+    a = std::move(a) >= AsyncAddOne;
+
+  int result = 0;
+  for (auto _ : state)
+    a([&result] (int i) { result += i; });
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchBindChainRun)->Range(1, 64);
+
+void benchApplyRendezvous(benchmark::State& state)
+{
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = async::apply(fmap(add2, pure(1)), pure(2));
+    std::move(a)([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchApplyRendezvous);
+
+// An applicative pipeline of three arguments: fmap, then two applies of the
+// curried function
+int add3(int x, int y, int z)
+{
+  return x + y + z;
+}
+
+void benchApplyCurried(benchmark::State& state)
+{
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = async::apply(async::apply(fmap(add3, pure(1)), pure(2)), pure(3));
+    std::move(a)([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchApplyCurried);
+
+void benchExprApplyCurried(benchmark::State& state)
+{
+  namespace ex = async::expr;
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = ex::apply(ex::apply(ex::fmap(add3, ex::pure(1)), ex::pure(2)), ex::pure(3));
+    a([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchExprApplyCurried);
+
+void benchRace(benchmark::State& state)
+{
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = race(pure(1), pure(2));
+    std::move(a)([&result] (const Either<int, int>& e) { result += e.m_left; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchRace);
+
+// Either special members, for a trivial payload and one which allocates
+template <typename E>
+E makeEither(bool right);
+
+template <>
+Either<int, int> makeEither<Either<int, int>>(bool right)
+{
+  return right ? Either<int, int>(1) : Either<int, int>(2, true);
+}
+
+template <>
+Either<string, int> makeEither<Either<string, int>>(bool right)
+{
+  return right
+    ? Either<string, int>(1)
+    : Either<string, int>(string("a reasonably long error message"), true);
+}
+
+template <typename E>
+void benchEitherCopy(benchmark::State& state)
+{
+  E e = makeEither<E>(false);
+  for (auto _ : state)
+  {
+    E c(e);
+    benchmark::DoNotOptimize(c);
+  }
+}
+BENCHMARK(benchEitherCopy<Either<int, int>>);
+BENCHMARK(benchEitherCopy<Either<string, int>>);
+
+// A move construction and a move assignment back
+template <typename E>
+void benchEitherMove(benchmark::State& state)
+{
+  E e = makeEither<E>(false);
+  for (auto _ : state)
+  {
+    E m(std::move(e));
+    benchmark::DoNotOptimize(m);
+    e = std::move(m);
+  }
+}
+BENCHMARK(benchEitherMove<Either<int, int>>);
+BENCHMARK(benchEitherMove<Either<string, int>>);
+
+// Copy assignment, alternating between a Left and a Right
+template <typename E>
+void benchEitherAssign(benchmark::State& state)
+{
+  const E es[2] = { makeEither<E>(false), makeEither<E>(true) };
+  E e = es[0];
+  std::size_t i = 0;
+  for (auto _ : state)
+  {
+    e = es[++i & 1];
+    benchmark::DoNotOptimize(e);
+  }
+}
+BENCHMARK(benchEitherAssign<Either<int, int>>);
+BENCHMARK(benchEitherAssign<Either<string, int>>);
+
+__attribute__((noinline)) Either<int, int> CheckedAddOne(int i)
+{
+  return Either<int, int>(i + 1);
+}
+
+void benchEitherChain(benchmark::State& state)
+{
+  const long depth = state.range(0);
+  auto step = [] (int i) { return CheckedAddOne(i); };
+  for (auto _ : state)
+  {
+    Either<int, int> e(0);
+    for (long i = 0; i < depth; ++i)
+      e = either::bind(step, std::move(e));
+    benchmark::DoNotOptimize(e);
+  }
+}
+BENCHMARK(benchEitherChain)->Range(1, 64);
+
+// A Left carried down a chain: it should be moved at each step, not copied
+void benchEitherChainError(benchmark::State& state)
+{
+  const long depth = state.range(0);
+  auto step = [] (int i) { return Either<string, int>(i + 1); };
+  for (auto _ : state)
+  {
+    auto e = makeEither<Either<string, int>>(false);
+    for (long i = 0; i < depth; ++i)
+      e = either::bind(step, std::move(e));
+    benchmark::DoNotOptimize(e);
+  }
+}
+BENCHMARK(benchEitherChainError)->Range(1, 64);
+
+//------------------------------------------------------------------------------
+// apply and race on 16 threads at once, with their shared states from
+// new/delete against the per-thread pool, installed as each thread's current
+// resource. An op is 20k of each on every thread.
+
+void applyAndRaceOnThreads(MemoryResource& r)
+{
+  const int threads = 16;
+  const int perThread = 20000;
+  std::atomic<long> result{0};
+  std::vector<std::thread> ts;
+  for (int t = 0; t < threads; ++t)
+    ts.emplace_back([&result, &r, perThread] {
+        // the resource is current while the Asyncs are built as well as
+        // started, so with UniqueFunction the closures come from it too
+        ResourceScope scope(r);
+        long sum = 0;
+        for (int i = 0; i < perThread; ++i)
+        {
+          auto a = async::apply(fmap(add2, pure(i)), pure(1));
+          std::move(a)([&sum] (int n) { sum += n; });
+          auto b = race(pure(i), pure(2));
+          std::move(b)([&sum] (const Either<int, int>& e) { sum += e.m_left; });
+        }
+        result += sum;
+      });
+  for (auto& t : ts)
+    t.join();
+  benchmark::DoNotOptimize(result);
+}
+
+void benchApplyRaceNewDelete(benchmark::State& state)
+{
+  for (auto _ : state)
+    applyAndRaceOnThreads(newDeleteResource());
+}
+BENCHMARK(benchApplyRaceNewDelete);
+
+void benchApplyRacePool(benchmark::State& state)
+{
+  for (auto _ : state)
+    applyAndRaceOnThreads(poolResource());
+}
+BENCHMARK(benchApplyRacePool);
+
+//------------------------------------------------------------------------------
+// A 4MB response body through pure, fmap and bind, handed back at the end:
+// a one-shot Async moves it all the way; an Async capturing it by lvalue (as
+// it must, to be startable again) copies it
+
+std::vector<char> Stamp(std::vector<char> v)
+{
+  v[0] = 'y';
+  return v;
+}
+
+Async<std::vector<char>> AsyncStamp(std::vector<char> v)
+{
+  return pure(Stamp(std::move(v)));
+}
+
+once::Async<std::vector<char>> OnceStamp(std::vector<char> v)
+{
+  return once::pure(Stamp(std::move(v)));
+}
+
+void benchBodyAsyncCopied(benchmark::State& state)
+{
+  std::vector<char> body(4 << 20, 'x');
+  for (auto _ : state)
+  {
+    auto a = fmap(Stamp, pure(body)) >= AsyncStamp;
+    std::move(a)([&body] (std::vector<char> v) { body = std::move(v); });
+  }
+  benchmark::DoNotOptimize(body.data());
+}
+BENCHMARK(benchBodyAsyncCopied);
+
+void benchBodyAsyncMoved(benchmark::State& state)
+{
+  std::vector<char> body(4 << 20, 'x');
+  for (auto _ : state)
+  {
+    auto a = fmap(Stamp, pure(std::move(body))) >= AsyncStamp;
+    std::move(a)([&body] (std::vector<char> v) { body = std::move(v); });
+  }
+  benchmark::DoNotOptimize(body.data());
+}
+BENCHMARK(benchBodyAsyncMoved);
+
+void benchBodyOnce(benchmark::State& state)
+{
+  std::vector<char> body(4 << 20, 'x');
+  for (auto _ : state)
+  {
+    auto a = once::bind(once::fmap(Stamp, once::pure(std::move(body))), OnceStamp);
+    std::move(a)([&body] (std::vector<char> v) { body = std::move(v); });
+  }
+  benchmark::DoNotOptimize(body.data());
+}
+BENCHMARK(benchBodyOnce);
+
+//------------------------------------------------------------------------------
+// A recursive loop of synchronous binds, one step per count. Without a
+// trampoline the stack grows with every step, so only the short loop can run
+// that way; with one, a million steps run in bounded stack.
+
+Async<int> CountDown(int n)
+{
+  if (n == 0)
+    return pure(0);
+  return pure(n - 1) >= CountDown;
+}
+
+void benchCountDown(benchmark::State& state)
+{
+  const int steps = static_cast<int>(state.range(0));
+  int result = 0;
+  for (auto _ : state)
+    CountDown(steps)([&result] (int i) { result += i; });
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchCountDown)->Arg(64);
+
+void benchCountDownTrampolined(benchmark::State& state)
+{
+  const int steps = static_cast<int>(state.range(0));
+  int result = 0;
+  for (auto _ : state)
+    trampoline(CountDown(steps))([&result] (int i) { result += i; });
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchCountDownTrampolined)->Arg(64)->Arg(1 << 20);
+
+//------------------------------------------------------------------------------
+// The same loop with repeat_until and for_each: one allocation per loop,
+// however many iterations, against two per step as recursive binds
+
+void benchRepeatUntil(benchmark::State& state)
+{
+  const int steps = static_cast<int>(state.range(0));
+  int n = 0;
+  Async<int> poll = [&n] (ContinuationT<int> f) { f(++n); };
+  auto a = repeat_until([steps] (int i) { return i == steps; }, std::move(poll));
+
+  int result = 0;
+  for (auto _ : state)
+  {
+    n = 0;
+    a([&result] (int i) { result += i; });
+  }
+  benchmark::DoNotOptimize(result);
+}
+BENCHMARK(benchRepeatUntil)->Arg(64)->Arg(1 << 20);
+
+void benchForEach(benchmark::State& state)
+{
+  const int steps = static_cast<int>(state.range(0));
+  int n = 0;
+  AsyncResult<Void, int> source = [&n, steps] (ContinuationT<Either<Void, int>> f) {
+    if (n == steps)
+      f(Either<Void, int>(Void(), true));
+    else
+      f(Either<Void, int>(n++));
+  };
+  long sum = 0;
+  auto a = for_each(std::move(source), [&sum] (int i) { sum += i; return pure(Void()); });
+
+  for (auto _ : state)
+  {
+    n = 0;
+    a([] (Void) {});
+  }
+  benchmark::DoNotOptimize(sum);
+}
+BENCHMARK(benchForEach)->Arg(64)->Arg(1 << 20);
+
+//------------------------------------------------------------------------------
+// 100k concurrent timeouts on one timer wheel: scheduling them, and how late
+// they fire. For comparison, the hand-rolled way: a sleeping thread per
+// timeout (only 1k of them).
+
+// An op schedules one timeout; they all fire after the loop
+void benchTimeouts(benchmark::State& state)
+{
+  using namespace std::chrono;
+  const std::size_t n = state.iterations();
+
+  TimerWheel wheel;
+  std::mutex m;
+  std::condition_variable cv;
+  std::size_t fired = 0;
+  long lateness = 0;
+
+  std::vector<steady_clock::time_point> deadlines;
+  deadlines.reserve(n);
+  std::size_t i = 0;
+  for (auto _ : state)
+  {
+    // deadlines spread over 10-110ms
+    auto d = microseconds(10000 + (i * 7919) % 100000);
+    deadlines.push_back(steady_clock::now() + d);
+    auto a = timeout(wheel, zero<int>(), d);
+    std::move(a)([&, i] (const Either<TimedOut, int>&) {
+        long late = duration_cast<microseconds>(steady_clock::now() - deadlines[i]).count();
+        std::lock_guard<std::mutex> g(m);
+        lateness = std::max(lateness, late);
+        if (++fired == n)
+          cv.notify_one();
+      });
+    ++i;
+  }
+  std::unique_lock<std::mutex> lock(m);
+  cv.wait(lock, [&] { return fired == n; });
+  state.counters["max_late_us"] = static_cast<double>(lateness);
+}
+BENCHMARK(benchTimeouts)->Iterations(100000);
+
+// An op starts a thread which sleeps for 10ms; they're joined after the loop
+void benchSleepingThreads(benchmark::State& state)
+{
+  using namespace std::chrono;
+  std::vector<std::thread> ts;
+  std::atomic<long> lateness{0};
+  for (auto _ : state)
+  {
+    auto deadline = steady_clock::now() + milliseconds(10);
+    ts.emplace_back([deadline, &lateness] {
+        std::this_thread::sleep_until(deadline);
+        long late = duration_cast<microseconds>(steady_clock::now() - deadline).count();
+        for (long l = lateness; l < late && !lateness.compare_exchange_weak(l, late); )
+          ;
+      });
+  }
+  for (auto& t : ts)
+    t.join();
+  state.counters["max_late_us"] = static_cast<double>(lateness.load());
+}
+BENCHMARK(benchSleepingThreads)->Iterations(1000);
+
+// A timeout which the Async wins, so its timer is scheduled and cancelled, with
+// however many other timeouts pending: the cost shouldn't depend on them
+void benchTimeoutWon(benchmark::State& state)
+{
+  TimerWheel wheel;
+  CancellationSource pending;
+  {
+    CancellationScope s(pending.token());
+    for (long i = 0; i < state.range(0); ++i)
+      timeout(wheel, zero<int>(), std::chrono::hours(1))([] (const Either<TimedOut, int>&) {});
+  }
+
+  int result = 0;
+  for (auto _ : state)
+  {
+    auto a = timeout(wheel, pure(1), std::chrono::milliseconds(100));
+    std::move(a)([&result] (const Either<TimedOut, int>& e) { result += e.m_right; });
+  }
+  benchmark::DoNotOptimize(result);
+  pending.cancel();
+}
+BENCHMARK(benchTimeoutWon)->Arg(0)->Arg(100000);
+
+//------------------------------------------------------------------------------
+// Echo over a socketpair: a client sends a message and reads it back, and a
+// server reads and writes it back, both on an EventLoop. For comparison, the
+// same with blocking sockets and a thread for the server. An op is 1000 round
+// trips of a message of the argument's size.
+//
+// Each side builds its Asyncs once, over IoRequests whose buffers it moves
+// along, and its continuations hold just a pointer to it, so a round trip
+// allocates nothing: the only allocations are starting each side's loop.
+
+const int s_echoTrips = 1000;
+
+// Echoes whatever it reads, until end of file
+struct EchoServer
+{
+  EchoServer(EventLoop& loop, int fd)
+    : buf(65536)
+    , in{loop, fd, MutableBuffer(buf)}
+    , out{loop, fd, ConstBuffer(buf)}
+    , readIn(read(in))
+    , writeOut(write(out))
+  {}
+
+  // one iteration: read, then write back what was read
+  void serve(ContinuationT<bool> c)
+  {
+    next = std::move(c);
+    readIn([this] (const IoResult& r) {
+        if (!r.isRight() || r.m_right == 0)
+        {
+          finish(true);
+          return;
+        }
+        out.buffer = ConstBuffer(buf.data(), r.m_right);
+        writeOut([this] (const IoResult& w) { finish(!w.isRight()); });
+      });
+  }
+
+  void finish(bool done)
+  {
+    auto c = std::move(next);
+    c(done);
+  }
+
+  std::vector<char> buf;
+  ReadRequest in;
+  WriteRequest out;
+  AsyncResult<std::error_code, std::size_t> readIn;
+  AsyncResult<std::error_code, std::size_t> writeOut;
+  ContinuationT<bool> next;
+};
+
+// Sends a message, reads until it has the whole reply, and repeats
+struct EchoClient
+{
+  EchoClient(EventLoop& loop, int fd, std::size_t size)
+    : msg(size, 'e')
+    , reply(size)
+    , in{loop, fd, MutableBuffer(reply)}
+    , out{loop, fd, ConstBuffer(msg)}
+    , readIn(read(in))
+    , writeOut(write(out))
+  {}
+
+  void send()
+  {
+    ++sent;
+    writeOut([] (const IoResult&) {});
+  }
+
+  // one iteration: read some of the reply, and send the next message once
+  // it's all there
+  void receive(ContinuationT<bool> c)
+  {
+    next = std::move(c);
+    in.buffer = MutableBuffer(&reply[got], reply.size() - got);
+    readIn([this] (const IoResult& r) {
+        if (!r.isRight() || r.m_right == 0)
+        {
+          finish(true);
+          return;
+        }
+        got += r.m_right;
+        if (got == reply.size())
+        {
+          got = 0;
+          if (sent == s_echoTrips)
+          {
+            finish(true);
+            return;
+          }
+          send();
+        }
+        finish(false);
+      });
+  }
+
+  void finish(bool done)
+  {
+    auto c = std::move(next);
+    c(done);
+  }
+
+  std::vector<char> msg;
+  std::vector<char> reply;
+  ReadRequest in;
+  WriteRequest out;
+  AsyncResult<std::error_code, std::size_t> readIn;
+  AsyncResult<std::error_code, std::size_t> writeOut;
+  ContinuationT<bool> next;
+  std::size_t got = 0;
+  int sent = 0;
+};
+
+void benchEchoLoop(benchmark::State& state)
+{
+  const std::size_t size = static_cast<std::size_t>(state.range(0));
+  EventLoop loop;
+  int s[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, s) != 0)
+  {
+    state.SkipWithError("no socketpair");
+    return;
+  }
+
+  std::mutex m;
+  std::condition_variable cv;
+  int finished = 0;
+  auto done = [&] (bool) {
+    std::lock_guard<std::mutex> g(m);
+    ++finished;
+    cv.notify_one();
+  };
+
+  EchoServer server(loop, s[0]);
+  repeat_until([] (bool b) { return b; },
+               Async<bool>([&server] (ContinuationT<bool> c) { server.serve(std::move(c)); }))(
+      done);
+
+  EchoClient client(loop, s[1], size);
+  auto trips = repeat_until(
+      [] (bool b) { return b; },
+      Async<bool>([&client] (ContinuationT<bool> c) { client.receive(std::move(c)); }));
+
+  int expected = 1;
+  for (auto _ : state)
+  {
+    client.sent = 0;
+    client.send();
+    trips(done);
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&] { return finished == expected; });
+    ++expected;
+  }
+  state.SetItemsProcessed(static_cast<long>(state.iterations()) * s_echoTrips);
+  state.SetBytesProcessed(static_cast<long>(state.iterations() * size) * s_echoTrips);
+
+  // closing the client ends the server
+  loop.forget(s[1]);
+  ::close(s[1]);
+  {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&] { return finished == expected; });
+  }
+  loop.forget(s[0]);
+  ::close(s[0]);
+}
+BENCHMARK(benchEchoLoop)->Arg(64)->Arg(4096)->Arg(65536);
+
+void benchEchoThread(benchmark::State& state)
+{
+  const std::size_t size = static_cast<std::size_t>(state.range(0));
+  int s[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) != 0)
+  {
+    state.SkipWithError("no socketpair");
+    return;
+  }
+  std::thread server([fd = s[0]] {
+      std::vector<char> buf(65536);
+      for (;;)
+      {
+        ssize_t n = ::read(fd, buf.data(), buf.size());
+        if (n <= 0)
+          return;
+        for (ssize_t w = 0; w < n; )
+        {
+          ssize_t k = ::write(fd, buf.data() + w, static_cast<std::size_t>(n - w));
+          if (k < 0)
+            return;
+          w += k;
+        }
+      }
+    });
+
+  std::vector<char> msg(size, 'e');
+  std::vector<char> reply(size);
+  for (auto _ : state)
+  {
+    for (int i = 0; i < s_echoTrips; ++i)
+    {
+      if (::write(s[1], msg.data(), size) != static_cast<ssize_t>(size))
+        break;
+      for (std::size_t got = 0; got < size; )
+      {
+        ssize_t n = ::read(s[1], reply.data() + got, size - got);
+        if (n <= 0)
+          break;
+        got += static_cast<std::size_t>(n);
+      }
+    }
+  }
+  state.SetItemsProcessed(static_cast<long>(state.iterations()) * s_echoTrips);
+  state.SetBytesProcessed(static_cast<long>(state.iterations() * size) * s_echoTrips);
+
+  ::close(s[1]);
+  server.join();
+  ::close(s[0]);
+}
+BENCHMARK(benchEchoThread)->Arg(64)->Arg(4096)->Arg(65536);
+
+//------------------------------------------------------------------------------
+// A fan-out of 1024 reads of 4k from a 16MB file, as log ingestion does: on
+// io_uring, on the pread fallback, and one at a time with blocking calls. An
+// op is the 1024 reads.
+
+const int s_fileReads = 1024;
+
+// The file, made on first use and removed at exit
+struct BenchFile
+{
+  BenchFile()
+  {
+    int fd = ::mkstemp(path);
+    if (fd < 0)
+    {
+      path[0] = 0;
+      return;
+    }
+    std::vector<char> block(1 << 20, 'x');
+    for (int i = 0; i < 16; ++i)
+      if (::write(fd, block.data(), block.size()) != static_cast<ssize_t>(block.size()))
+        break;
+    ::close(fd);
+  }
+
+  ~BenchFile()
+  {
+    if (path[0])
+      ::unlink(path);
+  }
+
+  static const char* get()
+  {
+    static BenchFile file;
+    return file.path[0] ? file.path : nullptr;
+  }
+
+  char path[32] = "/tmp/async_bench_XXXXXX";
+};
+
+std::uint64_t fileReadOffset(int i)
+{
+  return (static_cast<std::uint64_t>(i) * 7919 % 4096) * 4096;
+}
+
+void fileFanOut(benchmark::State& state, FileReader& reader, const std::string& path)
+{
+  std::size_t bytes = 0;
+  for (auto _ : state)
+  {
+    std::mutex m;
+    std::condition_variable cv;
+    int done = 0;
+    for (int i = 0; i < s_fileReads; ++i)
+    {
+      read_file(reader, path, fileReadOffset(i), 4096)([&] (const FileResult& f) {
+          std::lock_guard<std::mutex> g(m);
+          bytes += f.isRight() ? f.m_right.size() : 0;
+          if (++done == s_fileReads)
+            cv.notify_one();
+        });
+    }
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&] { return done == s_fileReads; });
+  }
+  state.SetBytesProcessed(static_cast<long>(bytes));
+}
+
+void benchFileFanOutUring(benchmark::State& state)
+{
+  const char* path = BenchFile::get();
+  if (!path)
+  {
+    state.SkipWithError("no temporary file");
+    return;
+  }
+  try
+  {
+    UringFileReader reader;
+    fileFanOut(state, reader, path);
+  }
+  catch (const std::system_error& e)
+  {
+    state.SkipWithError(std::string("io_uring unavailable: ") + e.what());
+  }
+}
+BENCHMARK(benchFileFanOutUring);
+
+void benchFileFanOutPread(benchmark::State& state)
+{
+  const char* path = BenchFile::get();
+  if (!path)
+  {
+    state.SkipWithError("no temporary file");
+    return;
+  }
+  PreadFileReader reader;
+  fileFanOut(state, reader, path);
+}
+BENCHMARK(benchFileFanOutPread);
+
+void benchFileOneAtATime(benchmark::State& state)
+{
+  const char* path = BenchFile::get();
+  if (!path)
+  {
+    state.SkipWithError("no temporary file");
+    return;
+  }
+  std::vector<char> block(4096);
+  long bytes = 0;
+  for (auto _ : state)
+  {
+    for (int i = 0; i < s_fileReads; ++i)
+    {
+      int f = ::open(path, O_RDONLY | O_CLOEXEC);
+      ssize_t n = ::pread(f, block.data(), block.size(), static_cast<off_t>(fileReadOffset(i)));
+      bytes += n > 0 ? n : 0;
+      ::close(f);
+    }
+  }
+  state.SetBytesProcessed(bytes);
+}
+BENCHMARK(benchFileOneAtATime);
+
+//------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+#ifdef ASYNC_USE_UNIQUE_FUNCTION
+  cout << "Async representation: UniqueFunction<"
+       << ASYNC_FUNCTION_SIZE << ">" << endl;
+#else
+  cout << "Async representation: std::function" << endl;
+#endif
+
+  // with an argument, run just the benchmarks whose names contain it
+  benchmark::runBenchmarks(argc > 1 ? argv[1] : nullptr);
+  return 0;
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Where the combinators' shared states (apply's rendezvous, race's state, the
+// when_all and when_any states) and UniqueFunction's heap-stored callables are
+// allocated. Each thread has a current MemoryResource, which is new/delete
+// unless a ResourceScope (or async::with_allocator) installs another:
+//
+//   async::ResourceScope scope(async::poolResource());
+//   ...
+//
+// A state remembers the resource it came from, so it can be freed on any
+// thread. The resource must outlive everything allocated from it.
+//
+// std::function can't be given an allocator, so with the default Async
+// representation the closures themselves still come from new; define
+// ASYNC_USE_UNIQUE_FUNCTION to route them here too.
+
+namespace async
+{
+  // Like std::pmr::memory_resource (which needs C++17). Alignments up to
+  // alignof(std::max_align_t) are supported.
+  class MemoryResource
+  {
+  public:
+    virtual ~MemoryResource() = default;
+    virtual void* allocate(std::size_t bytes, std::size_t align) = 0;
+    virtual void deallocate(void* p, std::size_t bytes, std::size_t align) noexcept = 0;
+  };
+
+  class NewDeleteResource : public MemoryResource
+  {
+  public:
+    void* allocate(std::size_t bytes, std::size_t) override
+    {
+      return ::operator new(bytes);
+    }
+
+    void deallocate(void* p, std::size_t, std::size_t) noexcept override
+    {
+      ::operator delete(p);
+    }
+  };
+
+  inline MemoryResource& newDeleteResource()
+  {
+    static NewDeleteResource r;
+    return r;
+  }
+
+  //----------------------------------------------------------------------------
+  // The current resource for this thread
+
+  inline MemoryResource*& currentResourceSlot()
+  {
+    thread_local MemoryResource* r = nullptr;
+    return r;
+  }
+
+  inline MemoryResource& currentResource()
+  {
+    MemoryResource* r = currentResourceSlot();
+    return r ? *r : newDeleteResource();
+  }
+
+  // Installs a resource as the current one for its lifetime.
+  class ResourceScope
+  {
+  public:
+    explicit ResourceScope(MemoryResource& r)
+      : m_previous(currentResourceSlot())
+    {
+      currentResourceSlot() = &r;
+    }
+
+    ~ResourceScope()
+    {
+      currentResourceSlot() = m_previous;
+    }
+
+    ResourceScope(const ResourceScope&) = delete;
+    ResourceScope& operator=(const ResourceScope&) = delete;
+
+  private:
+    MemoryResource* m_previous;
+  };
+
+  //----------------------------------------------------------------------------
+  // A standard allocator over a MemoryResource, for std::allocate_shared
+  template <typename T>
+  class Allocator
+  {
+  public:
+    using value_type = T;
+
+    explicit Allocator(MemoryResource& r) noexcept : m_resource(&r) {}
+
+    template <typename U>
+    Allocator(const Allocator<U>& other) noexcept : m_resource(other.resource()) {}
+
+    T* allocate(std::size_t n)
+    {
+      return static_cast<T*>(m_resource->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+      m_resource->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    MemoryResource* resource() const noexcept { return m_resource; }
+
+  private:
+    MemoryResource* m_resource;
+  };
+
+  template <typename T, typename U>
+  inline bool operator==(const Allocator<T>& a, const Allocator<U>& b) noexcept
+  {
+    return a.resource() == b.resource();
+  }
+
+  template <typename T, typename U>
+  inline bool operator!=(const Allocator<T>& a, const Allocator<U>& b) noexcept
+  {
+    return a.resource() != b.resource();
+  }
+
+  // make_shared, from the current resource
+  template <typename T, typename... Args>
+  inline std::shared_ptr<T> allocateShared(Args&&... args)
+  {
+    return std::allocate_shared<T>(Allocator<T>(currentResource()),
+                                   std::forward<Args>(args)...);
+  }
+
+  //----------------------------------------------------------------------------
+  // A pool of recently freed blocks, in size classes of 32 to 512 bytes, kept
+  // per thread: allocating and freeing touch only the calling thread's lists,
+  // with no locks or atomics. A block freed on another thread joins that
+  // thread's lists. Each list keeps at most s_maxCached blocks; beyond that,
+  // and for larger sizes, blocks go back to new/delete. Every PoolResource
+  // shares the same per-thread lists: use poolResource().
+  class PoolResource : public MemoryResource
+  {
+  public:
+    static const std::size_t s_minSize = 32;
+    static const std::size_t s_classes = 5;
+    static const std::size_t s_maxSize = s_minSize << (s_classes - 1);
+    static const std::size_t s_maxCached = 1024;
+
+    void* allocate(std::size_t bytes, std::size_t) override
+    {
+      if (bytes > s_maxSize)
+        return ::operator new(bytes);
+
+      std::size_t c = sizeClass(bytes);
+      Cache& cache = threadCache();
+      if (Block* b = cache.free[c])
+      {
+        cache.free[c] = b->next;
+        --cache.count[c];
+        return b;
+      }
+      return ::operator new(s_minSize << c);
+    }
+
+    void deallocate(void* p, std::size_t bytes, std::size_t) noexcept override
+    {
+      if (bytes > s_maxSize)
+      {
+        ::operator delete(p);
+        return;
+      }
+
+      std::size_t c = sizeClass(bytes);
+      Cache& cache = threadCache();
+      if (cache.closed || cache.count[c] == s_maxCached)
+      {
+        ::operator delete(p);
+        return;
+      }
+      Block* b = static_cast<Block*>(p);
+      b->next = cache.free[c];
+      cache.free[c] = b;
+      ++cache.count[c];
+    }
+
+  private:
+    struct Block
+    {
+      Block* next;
+    };
+
+    // Trivially destructible, so that it stays usable while other
+    // thread_locals are destroyed; the Drain empties it at thread exit.
+    struct Cache
+    {
+      Block* free[s_classes];
+      std::size_t count[s_classes];
+      bool closed;
+    };
+
+    struct Drain
+    {
+      explicit Drain(Cache& c) : cache(c) {}
+
+      ~Drain()
+      {
+        for (std::size_t c = 0; c < s_classes; ++c)
+        {
+          while (Block* b = cache.free[c])
+          {
+            cache.free[c] = b->next;
+            ::operator delete(b);
+          }
+          cache.count[c] = 0;
+        }
+        cache.closed = true;
+      }
+
+      Cache& cache;
+    };
+
+    static std::size_t sizeClass(std::size_t bytes)
+    {
+      std::size_t c = 0;
+      while ((s_minSize << c) < bytes)
+        ++c;
+      return c;
+    }
+
+    static Cache& threadCache()
+    {
+      thread_local Cache cache = {};
+      thread_local Drain drain(cache);
+      (void)drain;
+      return cache;
+    }
+  };
+
+  inline MemoryResource& poolResource()
+  {
+    static PoolResource r;
+    return r;
+  }
+}
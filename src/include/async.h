@@ -1,11 +1,19 @@
 #pragma once
 
+#include "allocator.h"
+#include "cancellation.h"
 #include "either.h"
 #include "function_traits.h"
+#include "instrument.h"
+#include "rendezvous.h"
+#include "trampoline.h"
+#include "unique_function.h"
 
+#include <atomic>
 #include <functional>
 #include <memory>
-#include <mutex>
+#include <new>
+#include <type_traits>
 #include <utility>
 
 //------------------------------------------------------------------------------
@@ -14,24 +22,46 @@
 //------------------------------------------------------------------------------
 // Simple type representing an asynchronous value which can be retrieved by
 // passing a continuation to receive it.
+//
+// By default Async and its continuations are std::functions. Defining
+// ASYNC_USE_UNIQUE_FUNCTION makes them move-only UniqueFunctions instead,
+// which avoids allocating for small captures (the inline buffer size is
+// ASYNC_FUNCTION_SIZE). In that mode Asyncs must be moved, not copied, into
+// combinators.
+
+#ifdef ASYNC_USE_UNIQUE_FUNCTION
+
+#ifndef ASYNC_FUNCTION_SIZE
+#define ASYNC_FUNCTION_SIZE UNIQUE_FUNCTION_DEFAULT_SIZE
+#endif
+
+template <typename Sig>
+using AsyncFunction = UniqueFunction<Sig, ASYNC_FUNCTION_SIZE>;
+
+#else
+
+template <typename Sig>
+using AsyncFunction = std::function<Sig>;
+
+#endif
 
 template <typename T>
 struct Continuation
 {
-  using type = std::function<void (std::decay_t<T>)>;
+  using type = AsyncFunction<void (std::decay_t<T>)>;
 };
 
 template <>
 struct Continuation<void>
 {
-  using type = std::function<void ()>;
+  using type = AsyncFunction<void ()>;
 };
 
 template <typename T>
 using ContinuationT = typename Continuation<T>::type;
 
 template <typename T>
-using Async = std::function<void (ContinuationT<T>)>;
+using Async = AsyncFunction<void (ContinuationT<T>)>;
 
 namespace async
 {
@@ -59,6 +89,18 @@ namespace async
     using type = void;
   };
 
+  template <typename T, std::size_t N, std::size_t M>
+  struct FromAsync<UniqueFunction<void (UniqueFunction<void (T), N>), M>>
+  {
+    using type = T;
+  };
+
+  template <std::size_t N, std::size_t M>
+  struct FromAsync<UniqueFunction<void (UniqueFunction<void (), N>), M>>
+  {
+    using type = void;
+  };
+
   template <typename T>
   using FromAsyncT = typename FromAsync<T>::type;
 
@@ -68,11 +110,14 @@ namespace async
   template <typename A>
   inline Async<A> pure(A&& a)
   {
-    return [a1 = std::forward<A>(a)]
+    return [ASYNC_PROBE(PURE) a1 = std::forward<A>(a)]
       (ContinuationT<A>&& cont) mutable
     {
       // Problem: how do we know whether or not the lambda itself is an rvalue
-      // (i.e. whether we can safely move the capture)?
+      // (i.e. whether we can safely move the capture)? We don't: this moves
+      // anyway, so a second start sees a moved-from value. Use a one-shot
+      // Async (async_once.h) where that matters.
+      ASYNC_COUNT(PURE, INVOCATIONS);
       cont(std::move(a1));
     };
   }
@@ -95,10 +140,11 @@ namespace async
     using A = FromAsyncT<AA>;
     using C = ContinuationT<typename function_traits<F>::appliedType>;
 
-    return [f1 = std::forward<F>(f), aa1 = std::forward<AA>(aa)]
+    return [ASYNC_PROBE(FMAP) f1 = std::forward<F>(f), aa1 = std::forward<AA>(aa)]
       (C&& cont)
     {
-      aa1([c = std::forward<C>(cont), f2 = std::move(f1)] (A&& a) {
+      aa1([ASYNC_PROBE(FMAP) c = std::forward<C>(cont), f2 = std::move(f1)] (A&& a) {
+          ASYNC_COUNT(FMAP, INVOCATIONS);
           c(function_traits<F>::apply(std::move(f2), std::forward<A>(a)));
         });
     };
@@ -107,7 +153,8 @@ namespace async
   // Apply an async function to an async argument: this is more involved. We
   // need to call each async, passing a continuation that stores its argument if
   // the other one isn't present, otherwise applies the function and calls the
-  // new continuation with the result.
+  // new continuation with the result. The two sides meet in a lock-free
+  // Rendezvous, which is the only allocation.
   // m (a -> b) -> m a -> m b
   template <typename AF, typename AA,
             // constraint: whatever's inside the Async<A> must be admissible as
@@ -124,44 +171,20 @@ namespace async
     using F = FromAsyncT<AF>;
     using C = ContinuationT<typename function_traits<F>::appliedType>;
 
-    struct Data
-    {
-      std::unique_ptr<F> pf;
-      std::unique_ptr<A> pa;
-      std::mutex m;
-    };
-    std::shared_ptr<Data> pData = std::make_shared<Data>();
-
-    return [pData, af1 = std::forward<AF>(af), aa1 = std::forward<AA>(aa)]
+    return [ASYNC_PROBE(APPLY) af1 = std::forward<AF>(af), aa1 = std::forward<AA>(aa)]
       (C&& cont)
     {
-      af1([pData, cont] (F&& f) {
-          bool have_a = false;
-          {
-            // if we don't have a already, store f
-            std::lock_guard<std::mutex> g(pData->m);
-            have_a = static_cast<bool>(pData->pa);
-            if (!have_a)
-              pData->pf = std::make_unique<F>(std::forward<F>(f));
-          }
-          // if we have both sides, call the continuation and we're done
-          if (have_a)
-            cont(function_traits<F>::apply(std::forward<F>(f), std::move(*pData->pa)));
-        });
-
-      aa1([pData, c = std::forward<C>(cont)] (A&& a) {
-          bool have_f = false;
-          {
-            // if we don't have f already, store a
-            std::lock_guard<std::mutex> g(pData->m);
-            have_f = static_cast<bool>(pData->pf);
-            if (!have_f)
-              pData->pa = std::make_unique<A>(std::forward<A>(a));
-          }
-          // if we have both sides, call the continuation and we're done
-          if (have_f)
-            c(function_traits<F>::apply(std::move(*pData->pf), std::forward<A>(a)));
-        });
+      // the continuation lives in the rendezvous so that whichever side
+      // arrives second can call it without either side copying it
+      auto pData = allocateShared<Rendezvous<F, A, C>>(std::forward<C>(cont));
+      ASYNC_COUNT_ALLOCATION(APPLY, sizeof(Rendezvous<F, A, C>));
+
+      af1([pData] (F&& f) {
+          ASYNC_COUNT(APPLY, INVOCATIONS);
+          pData->setF(std::forward<F>(f)); });
+      aa1([pData] (A&& a) {
+          ASYNC_COUNT(APPLY, INVOCATIONS);
+          pData->setA(std::forward<A>(a)); });
     };
   }
 
@@ -185,11 +208,29 @@ namespace async
     using AB = typename function_traits<F>::appliedType;
     using C = typename function_traits<AB>::template Arg<0>::bareType;
 
-    return [f1 = std::forward<F>(f), aa1 = std::forward<AA>(aa)]
+    return [ASYNC_PROBE(BIND) f1 = std::forward<F>(f), aa1 = std::forward<AA>(aa)]
       (C&& cont)
     {
-      aa1([c = std::forward<C>(cont), f2 = std::move(f1)] (A&& a) {
-          f2(std::forward<A>(a))(c); });
+      // carry the cancellation token across to the continuation, and don't
+      // start the next Async if it has been cancelled in the meantime
+      aa1([ASYNC_PROBE(BIND) c = std::forward<C>(cont), f2 = std::move(f1),
+           t = currentCancellation()] (A&& a) mutable {
+          ASYNC_COUNT(BIND, INVOCATIONS);
+          if (t.isCancelled())
+            return;
+          // deep inside a trampoline, the next step runs from the bottom
+          Trampoline& tr = Trampoline::current();
+          if (tr.full())
+          {
+            tr.defer([c = std::move(c), f2 = std::move(f2), t = std::move(t),
+                      a1 = std::forward<A>(a)] () mutable {
+                CancellationScope s(std::move(t));
+                f2(std::move(a1))(std::move(c)); });
+            return;
+          }
+          Trampoline::Frame fr(tr);
+          CancellationScope s(std::move(t));
+          f2(std::forward<A>(a))(std::move(c)); });
     };
   }
 
@@ -203,11 +244,25 @@ namespace async
     inline AB operator()(AA&& aa, F&& f)
     {
       using C = typename function_traits<AB>::template Arg<0>::bareType;
-      return [f1 = std::forward<F>(f), aa1 = std::forward<Async<A>>(aa)]
+      return [ASYNC_PROBE(SEQUENCE) f1 = std::forward<F>(f), aa1 = std::forward<Async<A>>(aa)]
         (C&& cont)
       {
-        aa1([c = std::forward<C>(cont), f2 = std::move(f1)] (A&&) {
-            f2()(c); });
+        aa1([ASYNC_PROBE(SEQUENCE) c = std::forward<C>(cont), f2 = std::move(f1),
+             t = currentCancellation()] (A&&) mutable {
+            ASYNC_COUNT(SEQUENCE, INVOCATIONS);
+            if (t.isCancelled())
+              return;
+            Trampoline& tr = Trampoline::current();
+            if (tr.full())
+            {
+              tr.defer([c = std::move(c), f2 = std::move(f2), t = std::move(t)] () mutable {
+                  CancellationScope s(std::move(t));
+                  f2()(std::move(c)); });
+              return;
+            }
+            Trampoline::Frame fr(tr);
+            CancellationScope s(std::move(t));
+            f2()(std::move(c)); });
       };
     }
   };
@@ -219,11 +274,25 @@ namespace async
     inline AB operator()(AA&& aa, F&& f)
     {
       using C = typename function_traits<AB>::template Arg<0>::bareType;
-      return [f1 = std::forward<F>(f), aa1 = std::forward<Async<void>>(aa)]
+      return [ASYNC_PROBE(SEQUENCE) f1 = std::forward<F>(f), aa1 = std::forward<Async<void>>(aa)]
         (C&& cont)
       {
-        aa1([c = std::forward<C>(cont), f2 = std::move(f1)] () {
-            f2()(c); });
+        aa1([ASYNC_PROBE(SEQUENCE) c = std::forward<C>(cont), f2 = std::move(f1),
+             t = currentCancellation()] () mutable {
+            ASYNC_COUNT(SEQUENCE, INVOCATIONS);
+            if (t.isCancelled())
+              return;
+            Trampoline& tr = Trampoline::current();
+            if (tr.full())
+            {
+              tr.defer([c = std::move(c), f2 = std::move(f2), t = std::move(t)] () mutable {
+                  CancellationScope s(std::move(t));
+                  f2()(std::move(c)); });
+              return;
+            }
+            Trampoline::Frame fr(tr);
+            CancellationScope s(std::move(t));
+            f2()(std::move(c)); });
       };
     }
   };
@@ -279,7 +348,7 @@ namespace async
                 typename function_traits<F>::template Arg<1>::type>::value, int> = 0>
   inline auto concurrently(AA&& aa, AB&& ab, F&& f)
   {
-    return apply(fmap(std::forward<F>(f), std::forward<AA>(aa)), std::forward<AB>(ab));
+    return async::apply(fmap(std::forward<F>(f), std::forward<AA>(aa)), std::forward<AB>(ab));
   }
 
   template <typename F, typename AA, typename AB, typename A, typename B>
@@ -326,6 +395,77 @@ namespace async
     }
   };
 
+  // Start an Async on an executor (anything with a post(UniqueFunction<void ()>)
+  // member, such as a ThreadPool). The Async's continuation runs wherever the
+  // Async completes, so for an Async that completes synchronously the rest of
+  // the chain runs on the executor too; in particular, && and concurrently
+  // run their operands in parallel when both are started via a thread pool.
+  template <typename Executor, typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline Async<A> via(Executor& ex, AA&& aa)
+  {
+    // the Async may be started more than once (and each task may outlive this
+    // particular invocation), so the tasks share it
+    using AD = std::decay_t<AA>;
+    auto pAsync = allocateShared<AD>(std::forward<AA>(aa));
+    ASYNC_COUNT_ALLOCATION(VIA, sizeof(AD));
+
+    return [ASYNC_PROBE(VIA) &ex, pAsync] (ContinuationT<A> cont)
+    {
+      ex.post([ASYNC_PROBE(VIA) pAsync, c = std::move(cont), t = currentCancellation()] () mutable {
+          ASYNC_COUNT(VIA, INVOCATIONS);
+          if (t.isCancelled())
+            return;
+          CancellationScope s(std::move(t));
+          (*pAsync)(std::move(c));
+        });
+    };
+  }
+
+  // An Async<void> which completes on an executor: use it to move the rest of
+  // a chain there, e.g. schedule_on(pool) > work.
+  template <typename Executor>
+  inline Async<void> schedule_on(Executor& ex)
+  {
+    return [&ex] (ContinuationT<void> cont)
+    {
+      ex.post(std::move(cont));
+    };
+  }
+
+  // Start an Async with a MemoryResource (see allocator.h) as the current one,
+  // so that the shared states (and, with UniqueFunction, the closures) made
+  // while starting it come from the resource. Whatever starts later on other
+  // threads, such as the rest of a chain after via, uses those threads' own
+  // current resource. The resource must outlive the Async's run.
+  template <typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline Async<A> with_allocator(MemoryResource& r, AA&& aa)
+  {
+    return [&r, aa1 = std::forward<AA>(aa)] (ContinuationT<A> cont)
+    {
+      ResourceScope s(r);
+      aa1(std::move(cont));
+    };
+  }
+
+  // Start an Async on this thread's trampoline (see trampoline.h): while it
+  // completes synchronously, the stack depth stays bounded however many bind
+  // and sequence steps it runs. Starting returns once the synchronous part of
+  // the chain, queued steps included, has run.
+  template <typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline Async<A> trampoline(AA&& aa)
+  {
+    return [aa1 = std::forward<AA>(aa)] (ContinuationT<A> cont)
+    {
+      Trampoline::current().run([&aa1, &cont] { aa1(std::move(cont)); });
+    };
+  }
+
   // The zero element of the Async monoid. It never calls its continuation.
   template <typename T = Void>
   inline Async<T> zero()
@@ -333,50 +473,102 @@ namespace async
     return [] (ContinuationT<T>) {};
   }
 
+  // The shared state for race. The first side to finish takes the
+  // continuation (releasing it from the state) and cancels the other side.
+  template <typename C>
+  class RaceData
+  {
+  public:
+    explicit RaceData(C&& c) { new (&m_cont) C(std::move(c)); }
+    explicit RaceData(const C& c) { new (&m_cont) C(c); }
+
+    RaceData(const RaceData&) = delete;
+    RaceData& operator=(const RaceData&) = delete;
+
+    ~RaceData()
+    {
+      if (!m_done.load(std::memory_order_relaxed))
+        cont().~C();
+      link.remove();
+    }
+
+    // Pass the result (made by the given function) on if we're first;
+    // otherwise drop it.
+    template <typename MakeResult>
+    void finish(MakeResult&& make)
+    {
+      if (m_done.exchange(true, std::memory_order_acq_rel))
+        return;
+      C c(std::move(cont()));
+      cont().~C();
+      link.remove();
+      cancellation.cancel();
+      c(make());
+    }
+
+    CancellationState cancellation;
+    CancellationRegistration link;  // to the enclosing cancellation
+
+  private:
+    C& cont() { return *reinterpret_cast<C*>(&m_cont); }
+
+    std::atomic<bool> m_done{false};
+    std::aligned_storage_t<sizeof(C), alignof(C)> m_cont;
+  };
+
+  // Start an Async under the race's cancellation token.
+  template <typename Data>
+  inline CancellationToken raceToken(const std::shared_ptr<Data>& pData)
+  {
+    // the token shares ownership of the race state: no extra allocation
+    auto pState = std::shared_ptr<CancellationState>(pData, &pData->cancellation);
+    pData->link = currentCancellation().link(pState);
+    return CancellationToken(std::move(pState));
+  }
+
   // Race two Asyncs: call the continuation with the result of the first one
-  // that completes. Problem: how to cancel the other one, how to clean up in
-  // case of ORing with zero.
+  // that completes. The other one is cancelled: it runs under a cancellation
+  // token (see cancellation.h) which the winner trips, so a cancellation-aware
+  // Async can stop early. Once the race is decided, the state no longer holds
+  // the continuation, so ORing with zero doesn't keep it alive.
   template <typename AA, typename AB,
             // constraint: AA must be an Async<A>, AB must be an Async<B>
             typename A = FromAsyncT<AA>, typename B = FromAsyncT<AB>>
   inline Async<Either<A,B>> race(AA&& aa, AB&& ab)
   {
-    struct Data
-    {
-      Data() : done(false) {}
-      bool done;
-      std::mutex m;
-    };
-    std::shared_ptr<Data> pData = std::make_shared<Data>();
-
     using C = ContinuationT<Either<A,B>>;
-    return [pData, aa1 = std::forward<AA>(aa), ab1 = std::forward<AB>(ab)]
+
+    return [ASYNC_PROBE(RACE) aa1 = std::forward<AA>(aa), ab1 = std::forward<AB>(ab)]
       (C&& cont)
     {
-      aa1([pData, c = std::forward<C>(cont)] (A&& a) {
-          bool done = false;
-          {
-            std::lock_guard<std::mutex> g(pData->m);
-            done = pData->done;
-            pData->done = true;
-          }
-          if (!done)
-            c(Either<A,B>(std::forward<A>(a), true));
+      // both sides share the one continuation
+      auto pData = allocateShared<RaceData<C>>(std::forward<C>(cont));
+      ASYNC_COUNT_ALLOCATION(RACE, sizeof(RaceData<C>));
+      CancellationScope scope(raceToken(pData));
+
+      aa1([pData] (A&& a) {
+          ASYNC_COUNT(RACE, INVOCATIONS);
+          pData->finish([&a] { return Either<A,B>(std::forward<A>(a), true); });
         });
 
-      ab1([pData, c = std::forward<C>(cont)] (B&& b) {
-          bool done = false;
-          {
-            std::lock_guard<std::mutex> g(pData->m);
-            done = pData->done;
-            pData->done = true;
-          }
-          if (!done)
-            c(Either<A,B>(std::forward<B>(b)));
+      ab1([pData] (B&& b) {
+          ASYNC_COUNT(RACE, INVOCATIONS);
+          pData->finish([&b] { return Either<A,B>(std::forward<B>(b)); });
         });
     };
   }
 
+  // Make a cancellation-aware Async: when started, f is called with the
+  // continuation and the current cancellation token.
+  template <typename T, typename F>
+  inline Async<T> cancellable(F&& f)
+  {
+    return [f1 = std::forward<F>(f)] (ContinuationT<T> cont) mutable
+    {
+      f1(std::move(cont), currentCancellation());
+    };
+  }
+
   template <typename AA, typename AB, typename A, typename B>
   struct runRace
   {
@@ -427,7 +619,9 @@ template <typename F, typename AA,
           std::enable_if_t<
             std::is_convertible<
               async::FromAsyncT<AA>,
-              typename function_traits<F>::template Arg<0>::type>::value, int> = 0>
+              typename function_traits<F>::template Arg<0>::type>::value, int> = 0,
+          // constraint: F must return an Async
+          typename = async::FromAsyncT<typename function_traits<F>::appliedType>>
 inline auto operator>=(AA&& a, F&& f)
 {
   return async::bind<F,AA>(std::forward<AA>(a),
@@ -436,7 +630,9 @@ inline auto operator>=(AA&& a, F&& f)
 
 template <typename F, typename AA,
           // constraint: AA must be an Async<A>
-          typename A = async::FromAsyncT<AA>>
+          typename A = async::FromAsyncT<AA>,
+          // constraint: F must return an Async
+          typename = async::FromAsyncT<typename function_traits<F>::returnType>>
 inline auto operator>(AA&& a, F&& f)
 {
   return async::sequence<F,AA,A>()(std::forward<AA>(a),
@@ -0,0 +1,448 @@
+#pragma once
+
+#include "async.h"
+
+//------------------------------------------------------------------------------
+// C++20 coroutine support: co_await an Async<T> from inside a Task<T>, and turn
+// a Task<T> back into an Async<T>. A chain of binds becomes straight-line code:
+//
+//   async::Task<char> firstChar(int i)
+//   {
+//     std::string s = co_await AsyncToString(i);
+//     co_return s[0];
+//   }
+//
+// Awaiting allocates nothing beyond the coroutine frame: the continuation
+// handed to the Async just captures a pointer to the awaiter, which lives in
+// the frame. Awaiting another Task doesn't go through an Async at all: the
+// awaiting coroutine transfers straight to the Task, and the Task straight
+// back when it finishes. Frames can be allocated with a custom allocator by
+// giving the coroutine std::allocator_arg_t, Alloc as its leading parameters.
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace async
+{
+  //----------------------------------------------------------------------------
+  // Awaiting an Async. The Async may complete synchronously, in which case we
+  // don't suspend at all, or later (on any thread), in which case whoever
+  // completes it resumes the coroutine.
+  template <typename AA, typename T = FromAsyncT<AA>>
+  class AsyncAwaiter
+  {
+  public:
+    explicit AsyncAwaiter(AA aa)
+      : m_async(std::move(aa))
+    {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+      m_handle = h;
+      m_async([this] (T t) {
+          m_value.emplace(std::move(t));
+          complete();
+        });
+      // if the value already arrived, carry on without suspending
+      return m_state.exchange(SUSPENDED, std::memory_order_acq_rel) != COMPLETED;
+    }
+
+    T await_resume() { return std::move(*m_value); }
+
+  private:
+    void complete()
+    {
+      if (m_state.exchange(COMPLETED, std::memory_order_acq_rel) == SUSPENDED)
+        m_handle.resume();
+    }
+
+    enum State { STARTED, SUSPENDED, COMPLETED };
+
+    AA m_async;
+    std::coroutine_handle<> m_handle;
+    std::optional<T> m_value;
+    std::atomic<State> m_state{STARTED};
+  };
+
+  template <typename AA>
+  class AsyncAwaiter<AA, void>
+  {
+  public:
+    explicit AsyncAwaiter(AA aa)
+      : m_async(std::move(aa))
+    {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+      m_handle = h;
+      m_async([this] () {
+          if (m_state.exchange(COMPLETED, std::memory_order_acq_rel) == SUSPENDED)
+            m_handle.resume();
+        });
+      return m_state.exchange(SUSPENDED, std::memory_order_acq_rel) != COMPLETED;
+    }
+
+    void await_resume() {}
+
+  private:
+    enum State { STARTED, SUSPENDED, COMPLETED };
+
+    AA m_async;
+    std::coroutine_handle<> m_handle;
+    std::atomic<State> m_state{STARTED};
+  };
+
+  // Make any Async awaitable (for use in coroutine types other than Task).
+  template <typename AA,
+            // constraint: AA must be an Async
+            typename = FromAsyncT<AA>>
+  inline AsyncAwaiter<std::decay_t<AA>> awaitable(AA&& aa)
+  {
+    return AsyncAwaiter<std::decay_t<AA>>(std::forward<AA>(aa));
+  }
+
+  //----------------------------------------------------------------------------
+  // Coroutine frame allocation. Every frame is preceded by a header recording
+  // how to free it (and the allocator, which goes first), so frames from
+  // different allocators can be deleted uniformly, without knowing their size.
+  struct CoroutineFrame
+  {
+    using Dealloc = void (*)(void*);
+
+    static constexpr std::size_t s_align = alignof(std::max_align_t);
+
+    static constexpr std::size_t padded(std::size_t n)
+    {
+      return (n + s_align - 1) & ~(s_align - 1);
+    }
+
+    struct Header
+    {
+      Dealloc dealloc;
+      std::size_t size;
+    };
+
+    template <typename Alloc>
+    static constexpr std::size_t prefix()
+    {
+      return padded(sizeof(Alloc)) + padded(sizeof(Header));
+    }
+
+    static Header* header(void* frame)
+    {
+      return reinterpret_cast<Header*>(static_cast<char*>(frame) - padded(sizeof(Header)));
+    }
+
+    template <typename Alloc>
+    static void* allocate(std::size_t n, const Alloc& a)
+    {
+      using Bytes = typename std::allocator_traits<Alloc>::template
+        rebind_alloc<std::max_align_t>;
+      Bytes bytes(a);
+      std::size_t total = prefix<Bytes>() + padded(n);
+      char* p = reinterpret_cast<char*>(
+          std::allocator_traits<Bytes>::allocate(bytes, total / s_align));
+      new (p) Bytes(std::move(bytes));
+      void* frame = p + prefix<Bytes>();
+      new (header(frame)) Header{&deallocate<Bytes>, total};
+      return frame;
+    }
+
+    template <typename Bytes>
+    static void deallocate(void* frame)
+    {
+      std::size_t total = header(frame)->size;
+      char* p = static_cast<char*>(frame) - prefix<Bytes>();
+      Bytes* pAlloc = reinterpret_cast<Bytes*>(p);
+      Bytes bytes(std::move(*pAlloc));
+      pAlloc->~Bytes();
+      std::allocator_traits<Bytes>::deallocate(
+          bytes, reinterpret_cast<std::max_align_t*>(p), total / s_align);
+    }
+
+    static void free(void* frame)
+    {
+      header(frame)->dealloc(frame);
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  // A lazily-started coroutine producing a T, which converts to an Async<T>.
+  // The Async runs the coroutine, so it can be started at most once.
+  template <typename T>
+  class Task;
+
+  template <typename T>
+  class TaskAwaiter;
+
+  template <typename T>
+  struct TaskPromiseBase
+  {
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // Async has no error channel (use an Either result for errors), and by the
+    // time the coroutine runs nobody is waiting on the Task to rethrow to.
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    template <typename AA,
+              // constraint: AA must be an Async
+              typename = FromAsyncT<AA>>
+    AsyncAwaiter<std::decay_t<AA>> await_transform(AA&& aa)
+    {
+      return AsyncAwaiter<std::decay_t<AA>>(std::forward<AA>(aa));
+    }
+
+    template <typename U>
+    TaskAwaiter<U> await_transform(Task<U>&& t)
+    {
+      return TaskAwaiter<U>(std::move(t));
+    }
+
+    static void* operator new(std::size_t n)
+    {
+      return CoroutineFrame::allocate(n, std::allocator<std::max_align_t>());
+    }
+
+    static void operator delete(void* p)
+    {
+      CoroutineFrame::free(p);
+    }
+
+    // Who to pass the result to: either the coroutine awaiting this one, or
+    // (when started as an Async) the continuation.
+    std::coroutine_handle<> m_awaiter;
+    ContinuationT<T> m_cont;
+  };
+
+  template <typename T>
+  struct TaskPromise : public TaskPromiseBase<T>
+  {
+    Task<T> get_return_object();
+
+    template <typename U>
+    void return_value(U&& u) { m_value.emplace(std::forward<U>(u)); }
+
+    // At the end, resume the awaiting coroutine (which takes the result and
+    // frees the frame), or free the frame and then pass on the result.
+    struct FinalAwaiter
+    {
+      bool await_ready() const noexcept { return false; }
+
+      template <typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+      {
+        if (h.promise().m_awaiter)
+          return h.promise().m_awaiter;
+        ContinuationT<T> c = std::move(h.promise().m_cont);
+        T t = std::move(*h.promise().m_value);
+        h.destroy();
+        c(std::move(t));
+        return std::noop_coroutine();
+      }
+
+      void await_resume() const noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    std::optional<T> m_value;
+  };
+
+  template <>
+  struct TaskPromise<void> : public TaskPromiseBase<void>
+  {
+    Task<void> get_return_object();
+
+    void return_void() {}
+
+    struct FinalAwaiter
+    {
+      bool await_ready() const noexcept { return false; }
+
+      template <typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+      {
+        if (h.promise().m_awaiter)
+          return h.promise().m_awaiter;
+        ContinuationT<void> c = std::move(h.promise().m_cont);
+        h.destroy();
+        c();
+        return std::noop_coroutine();
+      }
+
+      void await_resume() const noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+  };
+
+  // The promise of a coroutine taking std::allocator_arg_t, Alloc (after the
+  // object, for a member function): its frame comes from the allocator. Params
+  // are the coroutine's parameter types, so operator new needn't be a template
+  // (and is declared in the same class as its operator delete).
+  template <typename T, typename... Params>
+  struct AllocatingTaskPromise : public TaskPromise<T>
+  {
+    Task<T> get_return_object();
+
+    static void* operator new(std::size_t n, Params&... params)
+    {
+      return CoroutineFrame::allocate(n, frameAllocator(params...));
+    }
+
+    static void operator delete(void* p)
+    {
+      CoroutineFrame::free(p);
+    }
+
+  private:
+    template <typename Alloc, typename... Args>
+    static const Alloc& frameAllocator(std::allocator_arg_t, const Alloc& a, Args&...)
+    {
+      return a;
+    }
+
+    template <typename C, typename Alloc, typename... Args>
+    static const Alloc& frameAllocator(C&, std::allocator_arg_t, const Alloc& a, Args&...)
+    {
+      return a;
+    }
+  };
+
+  template <typename T>
+  class Task
+  {
+  public:
+    using promise_type = TaskPromise<T>;
+
+    template <typename P>
+    explicit Task(std::coroutine_handle<P> h)
+      : m_handle(h)
+      , m_promise(&h.promise())
+    {}
+
+    Task(Task&& other) noexcept
+      : m_handle(std::exchange(other.m_handle, nullptr))
+      , m_promise(other.m_promise)
+    {}
+
+    Task& operator=(Task&& other) noexcept
+    {
+      if (this != &other)
+      {
+        if (m_handle)
+          m_handle.destroy();
+        m_handle = std::exchange(other.m_handle, nullptr);
+        m_promise = other.m_promise;
+      }
+      return *this;
+    }
+
+    ~Task()
+    {
+      if (m_handle)
+        m_handle.destroy();
+    }
+
+    // The Async owns the coroutine until it is started; starting it a second
+    // time throws bad_function_call, like a used-up once::Async.
+    Async<T> toAsync() &&
+    {
+      auto pOwner = std::make_shared<Task>(std::move(*this));
+      return [pOwner] (ContinuationT<T> cont)
+      {
+        std::coroutine_handle<> h = std::exchange(pOwner->m_handle, nullptr);
+        if (!h)
+          throw std::bad_function_call();
+        pOwner->m_promise->m_cont = std::move(cont);
+        h.resume();
+      };
+    }
+
+    operator Async<T>() && { return std::move(*this).toAsync(); }
+
+  private:
+    friend class TaskAwaiter<T>;
+
+    // The handle is untyped because the promise may be an
+    // AllocatingTaskPromise.
+    std::coroutine_handle<> m_handle;
+    TaskPromise<T>* m_promise;
+  };
+
+  //----------------------------------------------------------------------------
+  // Awaiting a Task from another Task: start it by symmetric transfer, and it
+  // resumes us the same way when it finishes. The awaiter owns the Task, so
+  // frees its frame once the result is taken.
+  template <typename T>
+  class TaskAwaiter
+  {
+  public:
+    explicit TaskAwaiter(Task<T>&& t) : m_task(std::move(t)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+    {
+      m_task.m_promise->m_awaiter = h;
+      return m_task.m_handle;
+    }
+
+    T await_resume() { return std::move(*m_task.m_promise->m_value); }
+
+  private:
+    Task<T> m_task;
+  };
+
+  template <>
+  inline void TaskAwaiter<void>::await_resume() {}
+
+  template <typename T>
+  inline Task<T> TaskPromise<T>::get_return_object()
+  {
+    return Task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+  }
+
+  inline Task<void> TaskPromise<void>::get_return_object()
+  {
+    return Task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+  }
+
+  template <typename T, typename... Params>
+  inline Task<T> AllocatingTaskPromise<T, Params...>::get_return_object()
+  {
+    return Task<T>(std::coroutine_handle<AllocatingTaskPromise>::from_promise(*this));
+  }
+}
+
+namespace std
+{
+  // Coroutines returning a Task which take an allocator get the
+  // AllocatingTaskPromise.
+  template <typename T, typename Alloc, typename... Args>
+  struct coroutine_traits<async::Task<T>, allocator_arg_t, Alloc, Args...>
+  {
+    using promise_type = async::AllocatingTaskPromise<T, allocator_arg_t, Alloc, Args...>;
+  };
+
+  template <typename T, typename C, typename Alloc, typename... Args>
+  struct coroutine_traits<async::Task<T>, C, allocator_arg_t, Alloc, Args...>
+  {
+    using promise_type = async::AllocatingTaskPromise<T, C, allocator_arg_t, Alloc, Args...>;
+  };
+}
+
+#endif
@@ -0,0 +1,375 @@
+#pragma once
+
+#include "async.h"
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Statically-typed Asyncs. The combinators in async::expr mirror those in
+// async, but instead of returning an Async (a std::function) they return an
+// AsyncExpr whose type records the whole chain. Nothing is type-erased, so the
+// optimizer can inline straight through a composition. Call erase() to get an
+// Async back when a uniform type is needed.
+//
+// Like async::bind and sequence, expr::bind and sequence carry the current
+// cancellation across each step (and skip the step once it's cancelled), and
+// bound the stack on a trampoline (see trampoline.h). A chain started with no
+// token that can be cancelled, and outside a trampoline, has neither to do:
+// its steps call each other directly.
+
+namespace async
+{
+  // An asynchronous value of type T, computed by Impl. Impl is a callable
+  // taking a continuation of any type.
+  template <typename Impl, typename T>
+  struct AsyncExpr
+  {
+    using type = T;
+
+    explicit AsyncExpr(Impl impl)
+      : m_impl(std::move(impl))
+    {}
+
+    template <typename C>
+    inline void operator()(C&& cont)
+    {
+      m_impl(std::forward<C>(cont));
+    }
+
+    Impl m_impl;
+  };
+
+  // The result of calling an F& with Args (std::result_of is gone in C++20)
+  template <typename F, typename... Args>
+  using CallResultT = decltype(std::declval<F&>()(std::declval<Args>()...));
+
+  // IsAsyncExpr<T>::value is true if T is an AsyncExpr
+  template <typename T>
+  struct IsAsyncExpr : public std::false_type
+  {
+  };
+
+  template <typename Impl, typename T>
+  struct IsAsyncExpr<AsyncExpr<Impl, T>> : public std::true_type
+  {
+  };
+
+  template <typename T>
+  struct IsAsyncExpr<T&> : public IsAsyncExpr<T>
+  {
+  };
+
+  template <typename T>
+  struct IsAsyncExpr<const T> : public IsAsyncExpr<T>
+  {
+  };
+
+  // AsyncValue<T>::type is defined if T is an Async or an AsyncExpr
+  template <typename T>
+  struct AsyncValue : public FromAsync<T>
+  {
+  };
+
+  template <typename T>
+  struct AsyncValue<T&> : public AsyncValue<T>
+  {
+  };
+
+  template <typename T>
+  struct AsyncValue<const T> : public AsyncValue<T>
+  {
+  };
+
+  template <typename Impl, typename T>
+  struct AsyncValue<AsyncExpr<Impl, T>>
+  {
+    using type = T;
+  };
+
+  template <typename T>
+  using AsyncValueT = typename AsyncValue<T>::type;
+
+  namespace expr
+  {
+    template <typename T, typename Impl>
+    inline AsyncExpr<std::decay_t<Impl>, T> make(Impl&& impl)
+    {
+      return AsyncExpr<std::decay_t<Impl>, T>(std::forward<Impl>(impl));
+    }
+
+    // An AsyncExpr is already an AsyncExpr...
+    template <typename Impl, typename T>
+    inline AsyncExpr<Impl, T> lift(AsyncExpr<Impl, T> e)
+    {
+      return e;
+    }
+
+    // ...and an Async becomes one by forwarding the continuation to it.
+    template <typename AA, typename A = FromAsyncT<AA>>
+    inline auto lift(AA&& aa)
+    {
+      return make<A>([aa1 = std::forward<AA>(aa)] (auto&& cont) mutable
+      {
+        aa1(std::forward<decltype(cont)>(cont));
+      });
+    }
+
+    // Type-erase an AsyncExpr.
+    template <typename Impl, typename T>
+    inline Async<T> erase(AsyncExpr<Impl, T> e)
+    {
+      return [e1 = std::move(e)] (ContinuationT<T> cont) mutable
+      {
+        e1(std::move(cont));
+      };
+    }
+
+    // a -> m a
+    template <typename A>
+    inline auto pure(A&& a)
+    {
+      return make<std::decay_t<A>>([a1 = std::forward<A>(a)] (auto&& cont) mutable
+      {
+        cont(std::move(a1));
+      });
+    }
+
+    // (a -> b) -> m a -> m b
+    template <typename F, typename AE,
+              typename A = AsyncValueT<AE>,
+              // constraint: whatever's inside the AsyncExpr<A> must be
+              // admissible as F's first parameter
+              std::enable_if_t<
+                std::is_convertible<
+                  A, typename function_traits<F>::template Arg<0>::type>::value, int> = 0>
+    inline auto fmap(F&& f, AE&& ae)
+    {
+      using B = typename function_traits<F>::appliedType;
+
+      return make<B>([f1 = std::forward<F>(f), ae1 = lift(std::forward<AE>(ae))]
+                     (auto&& cont) mutable
+      {
+        ae1([c = std::forward<decltype(cont)>(cont), f2 = f1] (A a) mutable {
+            c(function_traits<F>::apply(std::move(f2), std::move(a)));
+          });
+      });
+    }
+
+    // m (a -> b) -> m a -> m b
+    template <typename EF, typename EA,
+              typename F = AsyncValueT<EF>, typename A = AsyncValueT<EA>,
+              // constraint: whatever's inside the AsyncExpr<A> must be
+              // admissible as F's first parameter
+              std::enable_if_t<
+                std::is_convertible<
+                  A, typename function_traits<F>::template Arg<0>::type>::value, int> = 0>
+    inline auto apply(EF&& ef, EA&& ea)
+    {
+      using B = typename function_traits<F>::appliedType;
+
+      return make<B>([ef1 = lift(std::forward<EF>(ef)), ea1 = lift(std::forward<EA>(ea))]
+                     (auto&& cont) mutable
+      {
+        using Data = Rendezvous<F, A, std::decay_t<decltype(cont)>>;
+        auto pData = allocateShared<Data>(std::forward<decltype(cont)>(cont));
+        ASYNC_COUNT_ALLOCATION(APPLY, sizeof(Data));
+
+        ef1([pData] (F f) { pData->setF(std::move(f)); });
+        ea1([pData] (A a) { pData->setA(std::move(a)); });
+      });
+    }
+
+    // Whether the steps of a chain started now can be called directly: with
+    // no token to carry and no trampoline to bounce off, there's nothing for a
+    // step to do but call the next one.
+    inline bool directSteps()
+    {
+      return !currentCanBeCancelled() && !Trampoline::activeHere();
+    }
+
+    // m a -> (a -> m b) -> m b
+    template <typename AE, typename F,
+              typename A = AsyncValueT<AE>,
+              typename B = AsyncValueT<CallResultT<F, A>>>
+    inline auto bind(AE&& ae, F&& f)
+    {
+      return make<B>([f1 = std::forward<F>(f), ae1 = lift(std::forward<AE>(ae))]
+                     (auto&& cont) mutable
+      {
+        if (directSteps())
+        {
+          ae1([c = std::forward<decltype(cont)>(cont), f2 = std::move(f1)] (A a) mutable {
+              f2(std::move(a))(std::move(c));
+            });
+          return;
+        }
+        ae1([c = std::forward<decltype(cont)>(cont), f2 = std::move(f1),
+             t = currentCancellation()] (A a) mutable {
+            if (t.isCancelled())
+              return;
+            Trampoline& tr = Trampoline::current();
+            if (tr.full())
+            {
+              tr.defer([c = std::move(c), f2 = std::move(f2), t = std::move(t),
+                        a1 = std::move(a)] () mutable {
+                  CancellationScope s(std::move(t));
+                  f2(std::move(a1))(std::move(c)); });
+              return;
+            }
+            Trampoline::Frame fr(tr);
+            CancellationScope s(std::move(t));
+            f2(std::move(a))(std::move(c));
+          });
+      });
+    }
+
+    // m a -> m b -> m b
+    template <typename AE, typename F,
+              typename = AsyncValueT<AE>,
+              typename B = AsyncValueT<CallResultT<F>>>
+    inline auto sequence(AE&& ae, F&& f)
+    {
+      return make<B>([f1 = std::forward<F>(f), ae1 = lift(std::forward<AE>(ae))]
+                     (auto&& cont) mutable
+      {
+        if (directSteps())
+        {
+          ae1([c = std::forward<decltype(cont)>(cont), f2 = std::move(f1)] (auto&&...) mutable {
+              f2()(std::move(c));
+            });
+          return;
+        }
+        ae1([c = std::forward<decltype(cont)>(cont), f2 = std::move(f1),
+             t = currentCancellation()] (auto&&...) mutable {
+            if (t.isCancelled())
+              return;
+            Trampoline& tr = Trampoline::current();
+            if (tr.full())
+            {
+              tr.defer([c = std::move(c), f2 = std::move(f2), t = std::move(t)] () mutable {
+                  CancellationScope s(std::move(t));
+                  f2()(std::move(c)); });
+              return;
+            }
+            Trampoline::Frame fr(tr);
+            CancellationScope s(std::move(t));
+            f2()(std::move(c));
+          });
+      });
+    }
+
+    // Convert a void AsyncExpr to a Void one; leave others alone.
+    template <typename AE>
+    inline auto ignore(AE&& ae)
+    {
+      return make<Void>([ae1 = lift(std::forward<AE>(ae))] (auto&& cont) mutable
+      {
+        ae1([c = std::forward<decltype(cont)>(cont)] (auto&&...) mutable {
+            c(Void());
+          });
+      });
+    }
+
+    template <typename AE>
+    inline auto toValue(AE&& ae, std::true_type)
+    {
+      return ignore(std::forward<AE>(ae));
+    }
+
+    template <typename AE>
+    inline auto toValue(AE&& ae, std::false_type)
+    {
+      return lift(std::forward<AE>(ae));
+    }
+
+    template <typename AE>
+    inline auto toValue(AE&& ae)
+    {
+      return toValue(std::forward<AE>(ae),
+                     std::is_void<AsyncValueT<AE>>());
+    }
+
+    // Run two AsyncExprs concurrently and pair their results; void results are
+    // converted to Void.
+    template <typename AA, typename AB>
+    inline auto both(AA&& aa, AB&& ab)
+    {
+      using IVA = IgnoreVoidT<AsyncValueT<AA>>;
+      using IVB = IgnoreVoidT<AsyncValueT<AB>>;
+      return expr::apply(fmap(std::make_pair<IVA, IVB>, toValue(std::forward<AA>(aa))),
+                   toValue(std::forward<AB>(ab)));
+    }
+
+    // Race two AsyncExprs: call the continuation with the result of the first
+    // one that completes, cancelling the other (see async::race).
+    template <typename AA, typename AB>
+    inline auto race(AA&& aa, AB&& ab)
+    {
+      using A = IgnoreVoidT<AsyncValueT<AA>>;
+      using B = IgnoreVoidT<AsyncValueT<AB>>;
+
+      return make<Either<A, B>>(
+          [aa1 = toValue(std::forward<AA>(aa)), ab1 = toValue(std::forward<AB>(ab))]
+          (auto&& cont) mutable
+      {
+        using Data = RaceData<std::decay_t<decltype(cont)>>;
+        auto pData = allocateShared<Data>(std::forward<decltype(cont)>(cont));
+        ASYNC_COUNT_ALLOCATION(RACE, sizeof(Data));
+        CancellationScope scope(raceToken(pData));
+
+        aa1([pData] (A a) {
+            pData->finish([&a] { return Either<A, B>(std::move(a), true); });
+          });
+        ab1([pData] (B b) {
+            pData->finish([&b] { return Either<A, B>(std::move(b)); });
+          });
+      });
+    }
+  }
+}
+
+// Syntactic sugar for AsyncExprs. These apply when at least one side is an
+// AsyncExpr (or, for >= and >, when the function returns one); the operators
+// in async.h handle the all-Async case.
+
+template <typename AA, typename F,
+          // constraint: AA must be an AsyncExpr, or an Async bound to a
+          // function returning an AsyncExpr
+          typename A = async::AsyncValueT<AA>,
+          std::enable_if_t<
+            async::IsAsyncExpr<AA>::value
+            || async::IsAsyncExpr<async::CallResultT<F, A>>::value, int> = 0>
+inline auto operator>=(AA&& a, F&& f)
+{
+  return async::expr::bind(std::forward<AA>(a), std::forward<F>(f));
+}
+
+template <typename AA, typename F,
+          typename A = async::AsyncValueT<AA>,
+          std::enable_if_t<
+            async::IsAsyncExpr<AA>::value
+            || async::IsAsyncExpr<async::CallResultT<F>>::value, int> = 0>
+inline auto operator>(AA&& a, F&& f)
+{
+  return async::expr::sequence(std::forward<AA>(a), std::forward<F>(f));
+}
+
+template <typename AA, typename AB,
+          typename = async::AsyncValueT<AA>, typename = async::AsyncValueT<AB>,
+          std::enable_if_t<
+            async::IsAsyncExpr<AA>::value || async::IsAsyncExpr<AB>::value, int> = 0>
+inline auto operator&&(AA&& a, AB&& b)
+{
+  return async::expr::both(std::forward<AA>(a), std::forward<AB>(b));
+}
+
+template <typename AA, typename AB,
+          typename = async::AsyncValueT<AA>, typename = async::AsyncValueT<AB>,
+          std::enable_if_t<
+            async::IsAsyncExpr<AA>::value || async::IsAsyncExpr<AB>::value, int> = 0>
+inline auto operator||(AA&& a, AB&& b)
+{
+  return async::expr::race(std::forward<AA>(a), std::forward<AB>(b));
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "async.h"
+#include "async_result.h"
+#include "file_reader.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Asyncs which read byte ranges of files, on a FileReader (by default a shared
+// one, io_uring if it works here and pread on a thread pool if not, made on
+// first use):
+//
+//   auto both = read_file("a.log", 0, 4096) && read_file("b.log", 0, 4096);
+//
+// The result is the bytes read (fewer than len at end of file) or the error;
+// the bytes are shared, not copied, by copies of the FileBuffer. The reader
+// must outlive every Async started on it.
+
+namespace async
+{
+  inline FileReader& defaultFileReader()
+  {
+    static std::unique_ptr<FileReader> reader = makeFileReader();
+    return *reader;
+  }
+
+  // Read up to len bytes of the file at path, from offset.
+  inline AsyncResult<std::error_code, FileBuffer> read_file(
+      FileReader& reader, std::string path, std::uint64_t offset, std::size_t len)
+  {
+    return [&reader, path = std::move(path), offset, len] (ContinuationT<FileResult> cont)
+    {
+      reader.startRead(path, offset, len, std::move(cont));
+    };
+  }
+
+  inline AsyncResult<std::error_code, FileBuffer> read_file(
+      std::string path, std::uint64_t offset, std::size_t len)
+  {
+    return read_file(defaultFileReader(), std::move(path), offset, len);
+  }
+}
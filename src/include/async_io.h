@@ -0,0 +1,116 @@
+#pragma once
+
+#include "async.h"
+#include "async_result.h"
+#include "event_loop.h"
+
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Asyncs for non-blocking file descriptors, on an EventLoop (by default a
+// shared one, started on first use):
+//
+//   read(fd, buf) >= [&] (const IoResult& r) { ... }
+//
+// Each completes on the calling thread if the fd is ready, otherwise on the
+// loop's thread. Building one captures its arguments; starting it (which may be
+// done again and again) allocates nothing more. The fd must be non-blocking,
+// and the buffer must stay valid until the Async completes.
+//
+// A loop, an fd and a buffer come to 32 bytes, more than std::function holds
+// without allocating (16 bytes in libstdc++, 24 in libc++), so building a
+// read or write from them allocates. For a stream of operations, keep their
+// arguments in an IoRequest instead: an Async made from one captures just a
+// pointer to it, and the buffer may be changed between starts, so a single
+// Async serves every read (or write) without allocating:
+//
+//   ReadRequest req{loop, fd, MutableBuffer(buf)};
+//   auto next = read(req);
+//   ...
+//   req.buffer = MutableBuffer(buf.data() + got, buf.size() - got);
+//   next(...);
+
+namespace async
+{
+  inline EventLoop& defaultEventLoop()
+  {
+    static EventLoop loop;
+    return loop;
+  }
+
+  // An Async which completes once fd may be readable.
+  inline Async<void> readable(EventLoop& loop, int fd)
+  {
+    return [&loop, fd] (ContinuationT<void> cont)
+    {
+      loop.startReadable(fd, std::move(cont));
+    };
+  }
+
+  inline Async<void> readable(int fd)
+  {
+    return readable(defaultEventLoop(), fd);
+  }
+
+  // Read up to b.size bytes from fd: the number read (0 at end of file), or
+  // the error.
+  inline AsyncResult<std::error_code, std::size_t> read(
+      EventLoop& loop, int fd, MutableBuffer b)
+  {
+    return [&loop, fd, b] (ContinuationT<IoResult> cont)
+    {
+      loop.startRead(fd, b, std::move(cont));
+    };
+  }
+
+  inline AsyncResult<std::error_code, std::size_t> read(int fd, MutableBuffer b)
+  {
+    return read(defaultEventLoop(), fd, b);
+  }
+
+  // Write all of b to fd: its size, or the error.
+  inline AsyncResult<std::error_code, std::size_t> write(
+      EventLoop& loop, int fd, ConstBuffer b)
+  {
+    return [&loop, fd, b] (ContinuationT<IoResult> cont)
+    {
+      loop.startWrite(fd, b, std::move(cont));
+    };
+  }
+
+  inline AsyncResult<std::error_code, std::size_t> write(int fd, ConstBuffer b)
+  {
+    return write(defaultEventLoop(), fd, b);
+  }
+
+  // The arguments of reads or writes, kept by the caller. It must outlive the
+  // Asyncs made from it.
+  template <typename Buffer>
+  struct IoRequest
+  {
+    EventLoop& loop;
+    int fd;
+    Buffer buffer;
+  };
+
+  using ReadRequest = IoRequest<MutableBuffer>;
+  using WriteRequest = IoRequest<ConstBuffer>;
+
+  // Read into req's buffer as it is when the Async is started.
+  inline AsyncResult<std::error_code, std::size_t> read(const ReadRequest& req)
+  {
+    return [&req] (ContinuationT<IoResult> cont)
+    {
+      req.loop.startRead(req.fd, req.buffer, std::move(cont));
+    };
+  }
+
+  // Write req's buffer as it is when the Async is started.
+  inline AsyncResult<std::error_code, std::size_t> write(const WriteRequest& req)
+  {
+    return [&req] (ContinuationT<IoResult> cont)
+    {
+      req.loop.startWrite(req.fd, req.buffer, std::move(cont));
+    };
+  }
+}
@@ -0,0 +1,431 @@
+#pragma once
+
+#include "async.h"
+#include "async_result.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Loops. A loop written as recursive binds builds a new Async (and allocates
+// new closures) for every iteration. repeat_until and for_each instead
+// allocate one state each time they're started, and every iteration runs out
+// of it:
+//
+//   // poll until the job is done
+//   auto done = repeat_until([] (const Status& s) { return s.done; }, poll);
+//
+//   // write every chunk; the stream ends with a Left (Void, or an error)
+//   Async<Void> copied = for_each(readChunk, writeChunk);
+//
+// Each iteration's continuation holds just a LoopRef to the state, which is
+// two words and trivially copyable, so it fits any Async representation's
+// small buffer, and iterating allocates nothing beyond what the body itself
+// does.
+//
+// An iteration which completes synchronously returns to the loop, which
+// starts the next one, so the stack stays bounded however many iterations
+// there are. One which completes later resumes the loop on whichever thread
+// completes it.
+//
+// Like bind, a loop carries the current cancellation across iterations; once
+// it is cancelled no further iteration starts, and the continuation is never
+// called. The state keeps itself alive until the loop ends or is cancelled, so
+// a body which never completes (and isn't cancelled) keeps it alive too.
+// Cancelling releases the state even while an iteration is outstanding; if
+// that iteration completes later, it finds the state gone and does nothing.
+
+namespace async
+{
+  //----------------------------------------------------------------------------
+  // A loop's iterations reach its state through a slot, which counts the
+  // references to the state. Slots are never freed, only reused, so a
+  // continuation which outlives its loop can still look at one, and finds
+  // that the generation has moved on. (A weak_ptr would do the same job, but
+  // isn't trivially copyable, and std::function allocates for any closure
+  // which isn't.)
+  class LoopSlot
+  {
+  public:
+    LoopSlot(const LoopSlot&) = delete;
+    LoopSlot& operator=(const LoopSlot&) = delete;
+
+    // A slot for state, holding one reference to it. Returns the generation.
+    static LoopSlot* acquire(void* state, std::uint32_t& generation)
+    {
+      LoopSlot* slot = nullptr;
+      {
+        std::lock_guard<std::mutex> g(freeMutex());
+        slot = freeList();
+        if (slot)
+          freeList() = slot->m_nextFree;
+      }
+      if (!slot)
+        slot = new LoopSlot;
+      slot->m_state = state;
+      generation = static_cast<std::uint32_t>(
+          slot->m_word.load(std::memory_order_relaxed) >> 32);
+      slot->m_word.store(word(generation, 1), std::memory_order_release);
+      return slot;
+    }
+
+    // Count a reference to the state, if it's still alive in the generation.
+    void* pin(std::uint32_t generation)
+    {
+      std::uint64_t w = m_word.load(std::memory_order_acquire);
+      for (;;)
+      {
+        if ((w >> 32) != generation || (w & 0xffffffffu) == 0)
+          return nullptr;
+        if (m_word.compare_exchange_weak(w, w + 1, std::memory_order_acq_rel))
+          return m_state;
+      }
+    }
+
+    // Drop a reference. If it was the last, the slot moves on to the next
+    // generation and is reused, and the caller destroys the state.
+    bool unpin()
+    {
+      std::uint64_t w = m_word.fetch_sub(1, std::memory_order_acq_rel);
+      if ((w & 0xffffffffu) != 1)
+        return false;
+      m_word.store(word(static_cast<std::uint32_t>(w >> 32) + 1, 0),
+                   std::memory_order_release);
+      std::lock_guard<std::mutex> g(freeMutex());
+      m_nextFree = freeList();
+      freeList() = this;
+      return true;
+    }
+
+    // The state, for the loop which holds a reference to it
+    void* state() const { return m_state; }
+
+  private:
+    LoopSlot() = default;
+
+    static std::uint64_t word(std::uint32_t generation, std::uint64_t references)
+    {
+      return (static_cast<std::uint64_t>(generation) << 32) | references;
+    }
+
+    static std::mutex& freeMutex()
+    {
+      static std::mutex m;
+      return m;
+    }
+
+    static LoopSlot*& freeList()
+    {
+      static LoopSlot* s_free = nullptr;
+      return s_free;
+    }
+
+    std::atomic<std::uint64_t> m_word{0};  // generation << 32 | references
+    void* m_state = nullptr;
+    LoopSlot* m_nextFree = nullptr;
+  };
+
+  // A reference to a loop's state which doesn't keep it alive
+  struct LoopRef
+  {
+    LoopSlot* slot;
+    std::uint32_t generation;
+  };
+
+  // The loop whose iterate() this thread is in, if any. Its state is alive
+  // until iterate() returns, so a continuation called from inside needn't pin
+  // it (and most iterations complete synchronously).
+  inline LoopRef& iteratingLoop()
+  {
+    static thread_local LoopRef s_ref{nullptr, 0};
+    return s_ref;
+  }
+
+  //----------------------------------------------------------------------------
+  // The state shared by the iterations of a loop. Derived::iterate() starts an
+  // iteration, which calls next() or finish() when it completes.
+  template <typename Derived, typename R>
+  class LoopState
+  {
+  public:
+    using C = ContinuationT<R>;
+
+    explicit LoopState(C&& cont)
+      : m_cont(std::move(cont))
+      , m_token(currentCancellation())
+    {}
+
+    // Run iterations, owned by self until the loop ends or is cancelled.
+    static void start(std::shared_ptr<Derived> self)
+    {
+      Derived* p = self.get();
+      p->m_self = std::move(self);
+      p->m_ref.slot = LoopSlot::acquire(p, p->m_ref.generation);
+      // An iteration which is outstanding when the loop is cancelled may never
+      // complete (a cancellation-aware body drops its continuation), so the
+      // state can't wait for it to be released.
+      p->m_registration = p->m_token.onCancel([r = p->m_ref] {
+          Pin s(r);
+          int phase = PENDING;
+          if (s && s->m_phase.compare_exchange_strong(phase, FINISHED, std::memory_order_acq_rel))
+            s->unpin();
+        });
+      p->run();
+    }
+
+  protected:
+    // Keeps the state alive while an iteration's continuation uses it, if
+    // the loop hasn't been released
+    class Pin
+    {
+    public:
+      explicit Pin(LoopRef r)
+      {
+        const LoopRef& i = iteratingLoop();
+        if (i.slot == r.slot && i.generation == r.generation)
+          m_p = static_cast<Derived*>(r.slot->state());
+        else
+        {
+          m_p = static_cast<Derived*>(r.slot->pin(r.generation));
+          m_pinned = true;
+        }
+      }
+
+      Pin(const Pin&) = delete;
+      Pin& operator=(const Pin&) = delete;
+
+      ~Pin()
+      {
+        if (m_p && m_pinned)
+          m_p->unpin();
+      }
+
+      explicit operator bool() const { return m_p != nullptr; }
+      Derived* operator->() const { return m_p; }
+
+    private:
+      Derived* m_p;
+      bool m_pinned = false;
+    };
+
+    // The state, for an iteration's continuation to pin
+    LoopRef ref() const { return m_ref; }
+
+    // The iteration is done; start the next one.
+    void next()
+    {
+      int phase = RUNNING;
+      if (m_phase.compare_exchange_strong(phase, COMPLETED, std::memory_order_acq_rel))
+        return;
+      // it completed after iterate() returned, so nothing else is running,
+      // unless cancellation finished the loop meanwhile
+      if (phase != PENDING
+          || !m_phase.compare_exchange_strong(phase, COMPLETED, std::memory_order_acq_rel))
+        return;
+      run();
+    }
+
+    // The loop is done. If iterate() hasn't returned, run() releases the
+    // state; otherwise it's released here.
+    void finish(R r)
+    {
+      int phase = m_phase.exchange(FINISHED, std::memory_order_acq_rel);
+      if (phase == FINISHED)
+        return;  // cancelled while the iteration was outstanding
+      m_registration.remove();
+      C c = std::move(m_cont);
+      c(std::move(r));
+      // the caller's pin keeps the state alive until it returns
+      if (phase == PENDING)
+        unpin();
+    }
+
+  private:
+    enum Phase : int
+    {
+      RUNNING,    // in iterate(), or in an iteration which hasn't completed
+      COMPLETED,  // the iteration completed before iterate() returned
+      PENDING,    // iterate() returned first: the iteration resumes the loop
+      FINISHED
+    };
+
+    // Drop a reference to the state, destroying it if that was the last
+    void unpin()
+    {
+      if (m_ref.slot->unpin())
+      {
+        auto self = std::move(m_self);
+      }
+    }
+
+    void run()
+    {
+      CancellationScope s(m_token);
+      for (;;)
+      {
+        if (m_token.isCancelled())
+        {
+          unpin();
+          return;
+        }
+
+        m_phase.store(RUNNING, std::memory_order_relaxed);
+        {
+          LoopRef outer = iteratingLoop();
+          iteratingLoop() = m_ref;
+          static_cast<Derived*>(this)->iterate();
+          iteratingLoop() = outer;
+        }
+
+        int phase = RUNNING;
+        if (m_phase.compare_exchange_strong(phase, PENDING, std::memory_order_acq_rel))
+          return;
+        if (phase == FINISHED)
+        {
+          unpin();
+          return;
+        }
+      }
+    }
+
+    C m_cont;
+    CancellationToken m_token;
+    CancellationRegistration m_registration;
+    std::atomic<int> m_phase{RUNNING};
+    std::shared_ptr<Derived> m_self;
+    LoopRef m_ref{};
+  };
+
+  //----------------------------------------------------------------------------
+  // What a loop runs, shared by every start of it (an Async may not be
+  // copyable)
+  template <typename P, typename A>
+  struct RepeatUntil
+  {
+    P pred;
+    Async<A> body;
+  };
+
+  template <typename P, typename A>
+  class RepeatUntilState : public LoopState<RepeatUntilState<P, A>, A>
+  {
+    using Base = LoopState<RepeatUntilState<P, A>, A>;
+    friend Base;
+
+  public:
+    RepeatUntilState(std::shared_ptr<RepeatUntil<P, A>> loop, typename Base::C&& cont)
+      : Base(std::move(cont))
+      , m_loop(std::move(loop))
+    {}
+
+  private:
+    void iterate()
+    {
+      ASYNC_COUNT(REPEAT_UNTIL, INVOCATIONS);
+      m_loop->body([r = this->ref()] (A a) {
+          typename Base::Pin self(r);
+          if (!self)
+            return;
+          if (self->m_loop->pred(a))
+            self->finish(std::move(a));
+          else
+            self->next();
+        });
+    }
+
+    std::shared_ptr<RepeatUntil<P, A>> m_loop;
+  };
+
+  // Start an Async over and over until its result satisfies a predicate, and
+  // produce that result.
+  // (a -> Bool) -> m a -> m a
+  template <typename P, typename AA,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline Async<A> repeat_until(P&& pred, AA&& body)
+  {
+    using L = RepeatUntil<std::decay_t<P>, A>;
+    using D = RepeatUntilState<std::decay_t<P>, A>;
+    using C = ContinuationT<A>;
+
+    auto pLoop = allocateShared<L>(L{std::forward<P>(pred), std::forward<AA>(body)});
+    return [ASYNC_PROBE(REPEAT_UNTIL) pLoop = std::move(pLoop)] (C&& cont)
+    {
+      auto pData = allocateShared<D>(pLoop, std::forward<C>(cont));
+      ASYNC_COUNT_ALLOCATION(REPEAT_UNTIL, sizeof(D));
+      D::start(std::move(pData));
+    };
+  }
+
+  //----------------------------------------------------------------------------
+  template <typename F, typename E, typename T>
+  struct ForEach
+  {
+    F f;
+    AsyncResult<E, T> source;
+  };
+
+  template <typename F, typename E, typename T>
+  class ForEachState : public LoopState<ForEachState<F, E, T>, E>
+  {
+    using Base = LoopState<ForEachState<F, E, T>, E>;
+    friend Base;
+
+  public:
+    ForEachState(std::shared_ptr<ForEach<F, E, T>> loop, typename Base::C&& cont)
+      : Base(std::move(cont))
+      , m_loop(std::move(loop))
+    {}
+
+  private:
+    void iterate()
+    {
+      ASYNC_COUNT(FOR_EACH, INVOCATIONS);
+      m_loop->source([r = this->ref()] (Either<E, T> et) {
+          typename Base::Pin self(r);
+          if (!self)
+            return;
+          if (!et.isRight())
+          {
+            self->finish(std::move(et.m_left));
+            return;
+          }
+          self->m_loop->f(std::move(et.m_right))([r] (auto&&...) {
+              typename Base::Pin s(r);
+              if (s)
+                s->next();
+            });
+        });
+    }
+
+    std::shared_ptr<ForEach<F, E, T>> m_loop;
+  };
+
+  // Pull items from a source until it produces a Left, starting f on each
+  // (and waiting for it) before pulling the next. Produce the Left.
+  // m (Either e a) -> (a -> m b) -> m e
+  template <typename F, typename AA,
+            // constraint: AA must be an Async<Either<E, T>>
+            typename ET = FromAsyncT<AA>,
+            typename E = typename FromEither<ET>::left,
+            typename T = typename FromEither<ET>::right,
+            // constraint: F must return an Async
+            typename = FromAsyncT<typename function_traits<F>::returnType>>
+  inline Async<E> for_each(AA&& source, F&& f)
+  {
+    using L = ForEach<std::decay_t<F>, E, T>;
+    using D = ForEachState<std::decay_t<F>, E, T>;
+    using C = ContinuationT<E>;
+
+    auto pLoop = allocateShared<L>(L{std::forward<F>(f), std::forward<AA>(source)});
+    return [ASYNC_PROBE(FOR_EACH) pLoop = std::move(pLoop)] (C&& cont)
+    {
+      auto pData = allocateShared<D>(pLoop, std::forward<C>(cont));
+      ASYNC_COUNT_ALLOCATION(FOR_EACH, sizeof(D));
+      D::start(std::move(pData));
+    };
+  }
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "async.h"
+
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// One-shot Asyncs. An async::once::Async<T> can only be started as an rvalue,
+// and starting it uses it up (starting it again throws bad_function_call, like
+// an empty std::function). Since each closure runs at most once, the
+// combinators here move their captures out when they run, so a payload
+// travels from pure to the final continuation without being copied:
+//
+//   auto a = once::fmap(parse, once::pure(std::move(body)));
+//   std::move(a)([] (Document d) { ... });
+//
+// Asyncs and continuations are move-only UniqueFunctions. Combinators take
+// their Async arguments by rvalue reference only, so passing an lvalue is a
+// compile error rather than a silent copy.
+
+namespace async
+{
+  namespace once
+  {
+    template <typename T>
+    struct Continuation
+    {
+      using type = UniqueFunction<void (std::decay_t<T>)>;
+    };
+
+    template <>
+    struct Continuation<void>
+    {
+      using type = UniqueFunction<void ()>;
+    };
+
+    template <typename T>
+    using ContinuationT = typename Continuation<T>::type;
+
+    template <typename T>
+    class Async
+    {
+      using Function = UniqueFunction<void (ContinuationT<T>)>;
+
+    public:
+      using type = T;
+
+      Async() = default;
+
+      template <typename F,
+                // constraint: don't hijack the move constructor
+                std::enable_if_t<!std::is_same<std::decay_t<F>, Async>::value, int> = 0>
+      Async(F&& f)
+        : m_f(std::forward<F>(f))
+      {}
+
+      Async(Async&&) = default;
+      Async& operator=(Async&&) = default;
+
+      // false once started
+      explicit operator bool() const noexcept { return static_cast<bool>(m_f); }
+
+      // Start the Async. It's released before it runs, so whatever it
+      // captured is destroyed by the time this returns, unless handed on.
+      void operator()(ContinuationT<T> cont) &&
+      {
+        Function f(std::move(m_f));
+        f(std::move(cont));
+      }
+
+    private:
+      Function m_f;
+    };
+
+    // FromOnce<T>::type is defined if T is a one-shot Async
+    template <typename T>
+    struct FromOnce
+    {
+    };
+
+    template <typename T>
+    struct FromOnce<Async<T>>
+    {
+      using type = T;
+    };
+
+    template <typename T>
+    using FromOnceT = typename FromOnce<T>::type;
+
+    // a -> m a
+    template <typename A>
+    inline Async<std::decay_t<A>> pure(A&& a)
+    {
+      using T = std::decay_t<A>;
+      return [ASYNC_PROBE(PURE) a1 = std::forward<A>(a)]
+        (ContinuationT<T> cont) mutable
+      {
+        ASYNC_COUNT(PURE, INVOCATIONS);
+        cont(std::move(a1));
+      };
+    }
+
+    // (a -> b) -> m a -> m b
+    template <typename F, typename A,
+              // constraint: A must be admissible as F's first parameter
+              std::enable_if_t<
+                std::is_convertible<
+                  A, typename function_traits<F>::template Arg<0>::type>::value, int> = 0>
+    inline Async<typename function_traits<F>::appliedType> fmap(
+        F&& f, Async<A>&& aa)
+    {
+      using C = ContinuationT<typename function_traits<F>::appliedType>;
+
+      return [ASYNC_PROBE(FMAP) f1 = std::forward<F>(f), aa1 = std::move(aa)]
+        (C cont) mutable
+      {
+        std::move(aa1)([ASYNC_PROBE(FMAP) c = std::move(cont), f2 = std::move(f1)]
+                       (A a) mutable {
+            ASYNC_COUNT(FMAP, INVOCATIONS);
+            c(function_traits<F>::apply(std::move(f2), std::move(a)));
+          });
+      };
+    }
+
+    // m (a -> b) -> m a -> m b
+    template <typename F, typename A,
+              // constraint: A must be admissible as F's first parameter
+              std::enable_if_t<
+                std::is_convertible<
+                  A, typename function_traits<F>::template Arg<0>::type>::value, int> = 0>
+    inline Async<typename function_traits<F>::appliedType> apply(
+        Async<F>&& af, Async<A>&& aa)
+    {
+      using C = ContinuationT<typename function_traits<F>::appliedType>;
+
+      return [ASYNC_PROBE(APPLY) af1 = std::move(af), aa1 = std::move(aa)]
+        (C cont) mutable
+      {
+        auto pData = allocateShared<Rendezvous<F, A, C>>(std::move(cont));
+        ASYNC_COUNT_ALLOCATION(APPLY, sizeof(Rendezvous<F, A, C>));
+
+        std::move(af1)([pData] (F f) {
+            ASYNC_COUNT(APPLY, INVOCATIONS);
+            pData->setF(std::move(f)); });
+        std::move(aa1)([pData] (A a) {
+            ASYNC_COUNT(APPLY, INVOCATIONS);
+            pData->setA(std::move(a)); });
+      };
+    }
+
+    // m a -> (a -> m b) -> m b
+    template <typename F, typename A,
+              // constraint: A must be admissible as F's first parameter
+              std::enable_if_t<
+                std::is_convertible<
+                  A, typename function_traits<F>::template Arg<0>::type>::value, int> = 0,
+              // constraint: F must return a one-shot Async
+              typename AB = typename function_traits<F>::returnType,
+              typename B = FromOnceT<AB>>
+    inline AB bind(Async<A>&& aa, F&& f)
+    {
+      using C = ContinuationT<B>;
+
+      return [ASYNC_PROBE(BIND) f1 = std::forward<F>(f), aa1 = std::move(aa)]
+        (C cont) mutable
+      {
+        // as for async::bind, carry the cancellation token across, and bounce
+        // off the trampoline when the stack is deep
+        std::move(aa1)([ASYNC_PROBE(BIND) c = std::move(cont), f2 = std::move(f1),
+                        t = currentCancellation()] (A a) mutable {
+            ASYNC_COUNT(BIND, INVOCATIONS);
+            if (t.isCancelled())
+              return;
+            Trampoline& tr = Trampoline::current();
+            if (tr.full())
+            {
+              tr.defer([c = std::move(c), f2 = std::move(f2), t = std::move(t),
+                        a1 = std::move(a)] () mutable {
+                  CancellationScope s(std::move(t));
+                  f2(std::move(a1))(std::move(c)); });
+              return;
+            }
+            Trampoline::Frame fr(tr);
+            CancellationScope s(std::move(t));
+            f2(std::move(a))(std::move(c));
+          });
+      };
+    }
+  }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "async.h"
+
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Asynchronous results which may fail: an AsyncResult<E, T> produces either an
+// error (Left) or a value (Right). fmapE and bindE work on the Right value and
+// short-circuit on a Left: the function is never called (so no Async is made
+// for the next stage), and the error is forwarded straight to the
+// continuation.
+
+template <typename E, typename T>
+using AsyncResult = Async<Either<E, T>>;
+
+namespace async
+{
+  // FromEither<T> destructures an Either
+  template <typename T>
+  struct FromEither
+  {
+  };
+
+  template <typename L, typename R, typename P>
+  struct FromEither<Either<L, R, P>>
+  {
+    using left = L;
+    using right = R;
+  };
+
+  // Lift a value into a successful result.
+  // a -> m (Either e a)
+  template <typename E, typename A>
+  inline AsyncResult<E, std::decay_t<A>> pureE(A&& a)
+  {
+    return pure(Either<E, std::decay_t<A>>(std::forward<A>(a)));
+  }
+
+  // Lift an error into a failed result.
+  // e -> m (Either e a)
+  template <typename T, typename E>
+  inline AsyncResult<std::decay_t<E>, T> failE(E&& e)
+  {
+    return pure(Either<std::decay_t<E>, T>(std::forward<E>(e), true));
+  }
+
+  // (a -> b) -> m (Either e a) -> m (Either e b)
+  template <typename F, typename AA,
+            // constraint: AA must be an Async<Either<E, A>>
+            typename EA = FromAsyncT<AA>,
+            typename E = typename FromEither<EA>::left,
+            typename A = typename FromEither<EA>::right,
+            // constraint: A must be admissible as F's argument
+            std::enable_if_t<
+              std::is_convertible<
+                A, typename function_traits<F>::template Arg<0>::type>::value, int> = 0>
+  inline AsyncResult<E, typename function_traits<F>::returnType> fmapE(
+      F&& f, AA&& aa)
+  {
+    using B = typename function_traits<F>::returnType;
+    using C = ContinuationT<Either<E, B>>;
+
+    return [ASYNC_PROBE(FMAP_E) f1 = std::forward<F>(f), aa1 = std::forward<AA>(aa)]
+      (C&& cont)
+    {
+      aa1([ASYNC_PROBE(FMAP_E) c = std::forward<C>(cont), f2 = std::move(f1)] (EA&& ea) {
+          ASYNC_COUNT(FMAP_E, INVOCATIONS);
+          if (!ea.isRight())
+            c(Either<E, B>(std::move(ea.m_left), true));
+          else
+            c(Either<E, B>(f2(std::move(ea.m_right))));
+        });
+    };
+  }
+
+  // m (Either e a) -> (a -> m (Either e b)) -> m (Either e b)
+  template <typename F, typename AA,
+            // constraint: AA must be an Async<Either<E, A>>
+            typename EA = FromAsyncT<AA>,
+            typename E = typename FromEither<EA>::left,
+            typename A = typename FromEither<EA>::right,
+            // constraint: A must be admissible as F's argument
+            std::enable_if_t<
+              std::is_convertible<
+                A, typename function_traits<F>::template Arg<0>::type>::value, int> = 0,
+            // constraint: F must return an Async<Either<E, B>>
+            typename AB = typename function_traits<F>::returnType,
+            typename EB = FromAsyncT<AB>,
+            std::enable_if_t<
+              std::is_same<E, typename FromEither<EB>::left>::value, int> = 0>
+  inline AB bindE(AA&& aa, F&& f)
+  {
+    using C = ContinuationT<EB>;
+
+    return [ASYNC_PROBE(BIND_E) f1 = std::forward<F>(f), aa1 = std::forward<AA>(aa)]
+      (C&& cont)
+    {
+      // a Left goes straight to the continuation; otherwise as for bind
+      aa1([ASYNC_PROBE(BIND_E) c = std::forward<C>(cont), f2 = std::move(f1),
+           t = currentCancellation()] (EA&& ea) mutable {
+          ASYNC_COUNT(BIND_E, INVOCATIONS);
+          if (t.isCancelled())
+            return;
+          if (!ea.isRight())
+          {
+            c(EB(std::move(ea.m_left), true));
+            return;
+          }
+          Trampoline& tr = Trampoline::current();
+          if (tr.full())
+          {
+            tr.defer([c = std::move(c), f2 = std::move(f2), t = std::move(t),
+                      ea1 = std::move(ea)] () mutable {
+                CancellationScope s(std::move(t));
+                f2(std::move(ea1.m_right))(std::move(c)); });
+            return;
+          }
+          Trampoline::Frame fr(tr);
+          CancellationScope s(std::move(t));
+          f2(std::move(ea.m_right))(std::move(c));
+        });
+    };
+  }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "async.h"
+#include "timer_wheel.h"
+
+#include <atomic>
+#include <chrono>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Timers. delay(d) is an Async<void> which completes once d has elapsed, and
+// timeout(aa, d) races aa against one:
+//
+//   timeout(fetch(url), 500ms)([] (const Either<TimedOut, Page>& e) { ... });
+//
+// A timer is scheduled on a TimerWheel (by default a shared one, with a 1ms
+// tick) when its Async is started, and completes on the wheel's thread. It is
+// cancelled along with the current cancellation, so whichever side of a race
+// loses, the timer is taken off the wheel when the other side wins. The wheel
+// must outlive every timer Async started on it.
+
+namespace async
+{
+  // The wheel used when none is given, started on first use
+  inline TimerWheel& defaultTimerWheel()
+  {
+    static TimerWheel w;
+    return w;
+  }
+
+  // The Left result of a timeout
+  struct TimedOut {};
+
+  // The link between a timer and the cancellation it was started under, so
+  // that whichever happens first (the timer fires or the token is cancelled)
+  // undoes the other. The registration is removed when the timer fires, so a
+  // long-lived token doesn't accumulate one per timer.
+  struct TimerLink
+  {
+    enum Phase : int { SCHEDULED, REGISTERED, FIRED };
+
+    explicit TimerLink(TimerWheel::Task&& f) : fire(std::move(f)) {}
+
+    TimerWheel::Task fire;
+    CancellationRegistration registration;
+    std::atomic<int> phase{SCHEDULED};
+  };
+
+  // Schedule a callback on a wheel, to be cancelled with the current
+  // cancellation. If that's already cancelled, nothing is scheduled.
+  template <typename Rep, typename Period>
+  inline void startTimer(TimerWheel& w, std::chrono::duration<Rep, Period> d,
+                         TimerWheel::Task f)
+  {
+    const CancellationToken& t = currentCancellation();
+    if (t.isCancelled())
+      return;
+    if (!t.canBeCancelled())
+    {
+      w.schedule(d, std::move(f));
+      return;
+    }
+
+    auto link = allocateShared<TimerLink>(std::move(f));
+    auto h = w.schedule(d, [link] {
+        if (link->phase.exchange(TimerLink::FIRED, std::memory_order_acq_rel)
+            == TimerLink::REGISTERED)
+          link->registration.remove();
+        link->fire();
+      });
+    link->registration = t.onCancel([&w, h = std::move(h)] { w.cancel(h); });
+
+    // if the timer fired first, it left the registration to us
+    int phase = TimerLink::SCHEDULED;
+    if (!link->phase.compare_exchange_strong(phase, TimerLink::REGISTERED,
+                                             std::memory_order_acq_rel))
+      link->registration.remove();
+  }
+
+  // An Async which completes once d has elapsed.
+  template <typename Rep, typename Period>
+  inline Async<void> delay(TimerWheel& w, std::chrono::duration<Rep, Period> d)
+  {
+    return [&w, d] (ContinuationT<void> cont)
+    {
+      startTimer(w, d, std::move(cont));
+    };
+  }
+
+  template <typename Rep, typename Period>
+  inline Async<void> delay(std::chrono::duration<Rep, Period> d)
+  {
+    return delay(defaultTimerWheel(), d);
+  }
+
+  // Race an Async against a delay. An Async<void> produces Void.
+  template <typename AA, typename Rep, typename Period,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline Async<Either<TimedOut, IgnoreVoidT<A>>> timeout(
+      TimerWheel& w, AA&& aa, std::chrono::duration<Rep, Period> d)
+  {
+    Async<TimedOut> timer = [&w, d] (ContinuationT<TimedOut> cont)
+    {
+      startTimer(w, d, [c = std::move(cont)] () mutable { c(TimedOut()); });
+    };
+    return runRace<Async<TimedOut>, AA, TimedOut, A>()(
+        std::move(timer), std::forward<AA>(aa));
+  }
+
+  template <typename AA, typename Rep, typename Period,
+            // constraint: AA must be an Async<A>
+            typename A = FromAsyncT<AA>>
+  inline Async<Either<TimedOut, IgnoreVoidT<A>>> timeout(
+      AA&& aa, std::chrono::duration<Rep, Period> d)
+  {
+    return timeout(defaultTimerWheel(), std::forward<AA>(aa), d);
+  }
+}
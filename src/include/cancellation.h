@@ -0,0 +1,263 @@
+#pragma once
+
+#include "unique_function.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Cooperative cancellation. A CancellationState is a one-way flag plus the
+// callbacks to run when it is set; tokens share ownership of a state and let
+// Asyncs observe it.
+//
+// Combinators which can make work redundant (race) start their operands with a
+// token installed as the current cancellation for the thread, and combinators
+// which continue later (bind, sequence) carry the current token across to the
+// continuation. A cancellation-aware Async reads currentCancellation() when it
+// is started.
+
+namespace async
+{
+  class CancellationState
+  {
+  public:
+    // Identifies a registered callback, to remove it
+    struct Key
+    {
+      std::size_t index = 0;
+      std::uint64_t generation = 0;  // 0 for none
+    };
+
+    CancellationState() = default;
+    CancellationState(const CancellationState&) = delete;
+    CancellationState& operator=(const CancellationState&) = delete;
+
+    bool isCancelled() const noexcept
+    {
+      return m_cancelled.load(std::memory_order_acquire);
+    }
+
+    // Set the flag and run (then release) the callbacks. Returns true if this
+    // call did the cancelling.
+    bool cancel()
+    {
+      if (m_cancelled.exchange(true, std::memory_order_acq_rel))
+        return false;
+
+      std::vector<Slot> callbacks;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        callbacks.swap(m_callbacks);
+        m_free.clear();
+      }
+      for (auto& slot : callbacks)
+        if (slot.generation != 0)
+          slot.f();
+      return true;
+    }
+
+    // Register a callback to run on cancellation. If already cancelled, it runs
+    // immediately (and the key is for none).
+    Key onCancel(UniqueFunction<void ()> f)
+    {
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (!isCancelled())
+        {
+          Key k;
+          k.generation = ++m_generation;
+          if (m_free.empty())
+          {
+            k.index = m_callbacks.size();
+            m_callbacks.emplace_back();
+          }
+          else
+          {
+            k.index = m_free.back();
+            m_free.pop_back();
+          }
+          m_callbacks[k.index].f = std::move(f);
+          m_callbacks[k.index].generation = k.generation;
+          return k;
+        }
+      }
+      f();
+      return Key();
+    }
+
+    // Remove a callback which is no longer needed, releasing it. Does nothing
+    // once the state is cancelled: a callback may already be running.
+    void remove(Key k)
+    {
+      UniqueFunction<void ()> f;
+      std::lock_guard<std::mutex> g(m_mutex);
+      if (k.generation == 0 || k.index >= m_callbacks.size()
+          || m_callbacks[k.index].generation != k.generation)
+        return;
+      f = std::move(m_callbacks[k.index].f);
+      m_callbacks[k.index].generation = 0;
+      m_free.push_back(k.index);
+    }
+
+  private:
+    // Removed slots are reused, so registering and removing callbacks over and
+    // over doesn't grow the state.
+    struct Slot
+    {
+      UniqueFunction<void ()> f;
+      std::uint64_t generation = 0;
+    };
+
+    std::atomic<bool> m_cancelled{false};
+    std::mutex m_mutex;
+    std::vector<Slot> m_callbacks;
+    std::vector<std::size_t> m_free;
+    std::uint64_t m_generation = 0;
+  };
+
+  // A callback registered with a token. Removing the registration once the
+  // callback isn't needed (e.g. the work it would cancel has completed) keeps
+  // a long-lived token from accumulating callbacks. Dropping a registration
+  // leaves the callback registered. A registration doesn't keep the state
+  // alive, so a callback may own its own registration without a cycle.
+  class CancellationRegistration
+  {
+  public:
+    CancellationRegistration() = default;
+
+    CancellationRegistration(const std::shared_ptr<CancellationState>& state,
+                             CancellationState::Key key)
+      : m_key(key)
+    {
+      if (key.generation)
+        m_state = state;
+    }
+
+    // Remove the callback, unless it has already run (or is running).
+    void remove()
+    {
+      if (auto p = m_state.lock())
+        p->remove(m_key);
+      m_state.reset();
+    }
+
+  private:
+    std::weak_ptr<CancellationState> m_state;
+    CancellationState::Key m_key;
+  };
+
+  // A default-constructed token is never cancelled.
+  class CancellationToken
+  {
+  public:
+    CancellationToken() = default;
+
+    explicit CancellationToken(std::shared_ptr<CancellationState> state)
+      : m_state(std::move(state))
+    {}
+
+    bool isCancelled() const noexcept
+    {
+      return m_state && m_state->isCancelled();
+    }
+
+    // Whether this token can ever be cancelled
+    bool canBeCancelled() const noexcept
+    {
+      return static_cast<bool>(m_state);
+    }
+
+    CancellationRegistration onCancel(UniqueFunction<void ()> f) const
+    {
+      if (!m_state)
+        return CancellationRegistration();
+      auto k = m_state->onCancel(std::move(f));
+      return CancellationRegistration(m_state, k);
+    }
+
+    // Arrange for the given state to be cancelled when this token is.
+    CancellationRegistration link(const std::shared_ptr<CancellationState>& state) const
+    {
+      return onCancel([w = std::weak_ptr<CancellationState>(state)] {
+          if (auto p = w.lock())
+            p->cancel();
+        });
+    }
+
+  private:
+    std::shared_ptr<CancellationState> m_state;
+  };
+
+  // An owner of a cancellation state, for manual cancellation.
+  class CancellationSource
+  {
+  public:
+    CancellationSource()
+      : m_state(std::make_shared<CancellationState>())
+    {}
+
+    CancellationToken token() const { return CancellationToken(m_state); }
+    bool cancel() { return m_state->cancel(); }
+    bool isCancelled() const noexcept { return m_state->isCancelled(); }
+
+  private:
+    std::shared_ptr<CancellationState> m_state;
+  };
+
+  inline CancellationToken& currentCancellationSlot()
+  {
+    static thread_local CancellationToken s_token;
+    return s_token;
+  }
+
+  // Whether the current token can be cancelled, kept alongside it: a plain
+  // bool is cheaper to reach than the token, for code which can skip its
+  // cancellation handling altogether when it can't.
+  inline bool& currentCanBeCancelledSlot()
+  {
+    static thread_local bool s_canBeCancelled = false;
+    return s_canBeCancelled;
+  }
+
+  // The cancellation token for Asyncs being started on this thread.
+  inline const CancellationToken& currentCancellation()
+  {
+    return currentCancellationSlot();
+  }
+
+  inline bool currentCanBeCancelled()
+  {
+    return currentCanBeCancelledSlot();
+  }
+
+  // Install a token as the current cancellation for the lifetime of the scope.
+  class CancellationScope
+  {
+  public:
+    explicit CancellationScope(CancellationToken token)
+      : m_saved(std::move(currentCancellationSlot()))
+      , m_savedCanBeCancelled(currentCanBeCancelledSlot())
+    {
+      currentCanBeCancelledSlot() = token.canBeCancelled();
+      currentCancellationSlot() = std::move(token);
+    }
+
+    CancellationScope(const CancellationScope&) = delete;
+    CancellationScope& operator=(const CancellationScope&) = delete;
+
+    ~CancellationScope()
+    {
+      currentCancellationSlot() = std::move(m_saved);
+      currentCanBeCancelledSlot() = m_savedCanBeCancelled;
+    }
+
+  private:
+    CancellationToken m_saved;
+    bool m_savedCanBeCancelled;
+  };
+}
@@ -1,155 +1,377 @@
 #pragma once
 
 #include "function_traits.h"
+#include "instrument.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 //------------------------------------------------------------------------------
-// The either monad
+// Storage for the either monad: a discriminant and a union of the two
+// alternatives. When both alternatives are trivially copyable, so is the
+// storage (all the special members are defaulted), which means an
+// Either<int, int> can be memcpy'd and returned in registers. Otherwise the
+// special members dispatch on the discriminant (though if both alternatives
+// are trivially destructible, so is the storage).
+//
+// How the discriminant is stored is a policy:
+//
+//  - ByteTag: a one-byte tag in front of the union.
+//
+//  - NicheTag: no tag at all. One alternative is an empty type, and the
+//    other declares a niche -- a value it never holds -- by specializing
+//    either::Niche. The empty alternative is represented by the niche:
+//
+//      template <>
+//      struct either::Niche<Node*> { static constexpr Node* value = nullptr; };
+//
+//      static_assert(sizeof(Either<NotFound, Node*>) == sizeof(Node*), "");
+//
+// The default policy is NicheTag where it applies, and ByteTag otherwise.
 
-template <typename Left, typename Right>
-struct Either
+namespace either
 {
-  using L = Left;
-  using R = Right;
+  enum class Tag : std::uint8_t { LEFT, RIGHT };
 
-  // copy construct from a right value
-  explicit Either(const R& r)
-    noexcept(std::is_nothrow_copy_constructible<R>())
-    : m_tag(Tag::RIGHT)
-    , m_right(r)
-  {}
+  // Tags to select the alternative to construct
+  struct LeftTag {};
+  struct RightTag {};
 
-  // move construct from a right value
-  explicit Either(R&& r)
-    noexcept(std::is_nothrow_move_constructible<R>())
-    : m_tag(Tag::RIGHT)
-    , m_right(std::move(r))
-  {}
+  // Specialize with a static constexpr T value that T is never used to hold
+  template <typename T>
+  struct Niche
+  {};
 
-  // copy construct from a left value
-  Either(const L& l, bool)
-    noexcept(std::is_nothrow_copy_constructible<L>())
-    : m_tag(Tag::LEFT)
-    , m_left(l)
-  {}
+  template <typename T, typename = void>
+  struct HasNiche : std::false_type
+  {};
 
-  // move construct from a left value
-  Either(L&& l, bool)
-    noexcept(std::is_nothrow_move_constructible<L>())
-    : m_tag(Tag::LEFT)
-    , m_left(std::move(l))
-  {}
+  template <typename T>
+  struct HasNiche<T, decltype((void)Niche<T>::value)>
+    : std::integral_constant<bool,
+                             std::is_trivially_copyable<T>::value &&
+                             std::is_same<std::decay_t<decltype(Niche<T>::value)>, T>::value>
+  {};
 
-  // copy constructor
-  Either(const Either& other)
-    noexcept(std::is_nothrow_copy_constructible<L>() &&
-             std::is_nothrow_copy_constructible<R>())
-    : m_tag(other.m_tag)
+  struct ByteTag
   {
-    if (other.isRight())
-      new (&m_right) R(other.m_right);
-    else
-      new (&m_left) L(other.m_left);
-  }
+    template <typename L, typename R>
+    struct Discriminant
+    {
+      bool isRight(const void*) const { return m_tag == Tag::RIGHT; }
+      void setLeft(void*) { m_tag = Tag::LEFT; }
+      void setRight(void*) { m_tag = Tag::RIGHT; }
+
+      Tag m_tag;
+    };
+  };
 
-  // move constructor
-  Either(const Either&& other)
-    noexcept(std::is_nothrow_move_constructible<L>() &&
-             std::is_nothrow_move_constructible<R>())
-    : m_tag(other.m_tag)
+  struct NicheTag
   {
-    if (other.isRight())
-      new (&m_right) R(std::move(other.m_right));
-    else
-      new (&m_left) L(std::move(other.m_left));
-  }
+    template <typename L, typename R>
+    struct Discriminant
+    {
+      // the alternative with the niche, and the empty one
+      static constexpr bool s_nicheIsRight = std::is_empty<L>::value;
+      using N = std::conditional_t<s_nicheIsRight, R, L>;
+      using E = std::conditional_t<s_nicheIsRight, L, R>;
+
+      static_assert(std::is_empty<E>::value && std::is_trivially_copyable<E>::value,
+                    "NicheTag needs one alternative to be a trivial empty type");
+      static_assert(HasNiche<N>::value,
+                    "NicheTag needs the other alternative to declare a Niche");
+
+      bool isRight(const void* p) const { return holdsNiche(p) != s_nicheIsRight; }
+      void setLeft(void* p) { if (s_nicheIsRight) setNiche(p); }
+      void setRight(void* p) { if (!s_nicheIsRight) setNiche(p); }
+
+    private:
+      static bool holdsNiche(const void* p)
+      {
+        N n;
+        std::memcpy(&n, p, sizeof(N));
+        return n == Niche<N>::value;
+      }
 
-  // copy assignment
-  Either& operator=(const Either& other)
-    noexcept(std::is_nothrow_copy_assignable<L>() &&
-             std::is_nothrow_copy_assignable<R>() &&
-             std::is_nothrow_copy_constructible<L>() &&
-             std::is_nothrow_copy_constructible<R>())
+      // The empty alternative has no bytes of its own, so the niche can be
+      // written over it.
+      static void setNiche(void* p)
+      {
+        const N n = Niche<N>::value;
+        std::memcpy(p, &n, sizeof(N));
+      }
+    };
+  };
+
+  template <typename L, typename R>
+  using DefaultTag = std::conditional_t<
+    (std::is_empty<L>::value && std::is_trivially_copyable<L>::value && HasNiche<R>::value) ||
+    (std::is_empty<R>::value && std::is_trivially_copyable<R>::value && HasNiche<L>::value),
+    NicheTag, ByteTag>;
+
+  template <typename L, typename R>
+  struct IsTrivial
+    : std::integral_constant<bool,
+                             std::is_trivially_copyable<L>::value &&
+                             std::is_trivially_copyable<R>::value>
+  {};
+
+  template <typename L, typename R, typename P, bool = IsTrivial<L, R>::value>
+  struct Storage;
+
+  // The discriminant is a base class, so that an empty one takes no space.
+  template <typename L, typename R, typename P>
+  struct Storage<L, R, P, true>
+    : public P::template Discriminant<L, R>
   {
-    // if the tags match, a plain copy of the data member
-    if (isRight() == other.isRight())
+    template <typename A>
+    Storage(LeftTag, A&& a)
+      : m_left(std::forward<A>(a))
     {
-      if (isRight())
-        m_right = other.m_right;
-      else
-        m_left = other.m_left;
-      return *this;
+      this->setLeft(&m_left);
     }
 
-    // explicit deletion
-    if (isRight())
-      m_right.~R();
-    else
-      m_left.~L();
-
-    // placement new
-    m_tag = other.m_tag;
-    if (isRight())
-      new (&m_right) R(other.m_right);
-    else
-      new (&m_left) L(other.m_left);
-    return *this;
-  }
+    template <typename A>
+    Storage(RightTag, A&& a)
+      : m_right(std::forward<A>(a))
+    {
+      this->setRight(&m_right);
+    }
+
+    bool isRight() const { return P::template Discriminant<L, R>::isRight(&m_right); }
+
+    union
+    {
+      L m_left;
+      R m_right;
+    };
+  };
 
-  // move assignment
-  Either& operator=(Either&& other)
-    noexcept(std::is_nothrow_move_assignable<L>() &&
-             std::is_nothrow_move_assignable<R>() &&
-             std::is_nothrow_move_constructible<L>() &&
-             std::is_nothrow_move_constructible<R>())
+  // Constructing a copy (or a move) of whichever alternative another holds,
+  // and destroying whichever is held, for Alternatives and Storage
+  template <typename L, typename R>
+  struct Held
   {
-    // if the tags match, a plain copy of the data member
-    if (isRight() == other.isRight())
+    template <typename S, typename O>
+    static void construct(S& s, O&& other)
     {
-      if (isRight())
-        m_right = std::move(other.m_right);
+      if (other.isRight())
+      {
+        new (&s.m_right) R(std::forward<O>(other).m_right);
+        s.setRight(&s.m_right);
+      }
       else
-        m_left = std::move(other.m_left);
-      return *this;
+      {
+        new (&s.m_left) L(std::forward<O>(other).m_left);
+        s.setLeft(&s.m_left);
+      }
     }
 
-    // explicit deletion
-    if (isRight())
-      m_right.~R();
-    else
-      m_left.~L();
-
-    // placement new
-    m_tag = other.m_tag;
-    if (isRight())
-      new (&m_right) R(std::move(other.m_right));
-    else
-      new (&m_left) L(std::move(other.m_left));
-    return *this;
-  }
+    template <typename S>
+    static void destroy(S& s)
+    {
+      if (s.isRight())
+        s.m_right.~R();
+      else
+        s.m_left.~L();
+    }
+  };
 
-  ~Either()
+  // The discriminant and union of a Storage which isn't trivially copyable.
+  // Only when an alternative has a destructor to run is there one here, so if
+  // both are trivially destructible, so is the Storage.
+  template <typename L, typename R, typename P,
+            bool = std::is_trivially_destructible<L>::value &&
+                   std::is_trivially_destructible<R>::value>
+  struct Alternatives
+    : public P::template Discriminant<L, R>
   {
-    if (isRight())
-      m_right.~R();
-    else
-      m_left.~L();
-  }
+    template <typename A>
+    Alternatives(LeftTag, A&& a)
+      : m_left(std::forward<A>(a))
+    {
+      this->setLeft(&m_left);
+    }
+
+    template <typename A>
+    Alternatives(RightTag, A&& a)
+      : m_right(std::forward<A>(a))
+    {
+      this->setRight(&m_right);
+    }
+
+    Alternatives(const Alternatives& other) { Held<L, R>::construct(*this, other); }
+    Alternatives(Alternatives&& other) { Held<L, R>::construct(*this, std::move(other)); }
 
-  enum class Tag { LEFT, RIGHT } m_tag;
-  union
+    bool isRight() const { return P::template Discriminant<L, R>::isRight(&m_right); }
+
+    union
+    {
+      L m_left;
+      R m_right;
+    };
+  };
+
+  template <typename L, typename R, typename P>
+  struct Alternatives<L, R, P, false>
+    : public P::template Discriminant<L, R>
   {
-    L m_left;
-    R m_right;
+    template <typename A>
+    Alternatives(LeftTag, A&& a)
+      : m_left(std::forward<A>(a))
+    {
+      this->setLeft(&m_left);
+    }
+
+    template <typename A>
+    Alternatives(RightTag, A&& a)
+      : m_right(std::forward<A>(a))
+    {
+      this->setRight(&m_right);
+    }
+
+    Alternatives(const Alternatives& other) { Held<L, R>::construct(*this, other); }
+    Alternatives(Alternatives&& other) { Held<L, R>::construct(*this, std::move(other)); }
+
+    ~Alternatives() { Held<L, R>::destroy(*this); }
+
+    bool isRight() const { return P::template Discriminant<L, R>::isRight(&m_right); }
+
+    union
+    {
+      L m_left;
+      R m_right;
+    };
   };
 
-  bool isRight() const { return m_tag == Tag::RIGHT; }
+  template <typename L, typename R, typename P>
+  struct Storage<L, R, P, false>
+    : public Alternatives<L, R, P>
+  {
+    template <typename A>
+    Storage(LeftTag t, A&& a)
+      : Alternatives<L, R, P>(t, std::forward<A>(a))
+    {}
+
+    template <typename A>
+    Storage(RightTag t, A&& a)
+      : Alternatives<L, R, P>(t, std::forward<A>(a))
+    {}
+
+    // copy constructor
+    Storage(const Storage& other)
+      noexcept(std::is_nothrow_copy_constructible<L>() &&
+               std::is_nothrow_copy_constructible<R>())
+      : Alternatives<L, R, P>(other)
+    {
+      ASYNC_COUNT(EITHER, COPIES);
+    }
+
+    // move constructor
+    Storage(Storage&& other)
+      noexcept(std::is_nothrow_move_constructible<L>() &&
+               std::is_nothrow_move_constructible<R>())
+      : Alternatives<L, R, P>(std::move(other))
+    {
+      ASYNC_COUNT(EITHER, MOVES);
+    }
+
+    // copy assignment
+    Storage& operator=(const Storage& other)
+      noexcept(std::is_nothrow_copy_assignable<L>() &&
+               std::is_nothrow_copy_assignable<R>() &&
+               std::is_nothrow_copy_constructible<L>() &&
+               std::is_nothrow_copy_constructible<R>())
+    {
+      ASYNC_COUNT(EITHER, COPIES);
+      // if the tags match, a plain copy of the data member
+      if (this->isRight() == other.isRight())
+      {
+        if (this->isRight())
+          this->m_right = other.m_right;
+        else
+          this->m_left = other.m_left;
+        return *this;
+      }
+
+      // explicit deletion, then placement new
+      Held<L, R>::destroy(*this);
+      Held<L, R>::construct(*this, other);
+      return *this;
+    }
+
+    // move assignment
+    Storage& operator=(Storage&& other)
+      noexcept(std::is_nothrow_move_assignable<L>() &&
+               std::is_nothrow_move_assignable<R>() &&
+               std::is_nothrow_move_constructible<L>() &&
+               std::is_nothrow_move_constructible<R>())
+    {
+      ASYNC_COUNT(EITHER, MOVES);
+      // if the tags match, a plain copy of the data member
+      if (this->isRight() == other.isRight())
+      {
+        if (this->isRight())
+          this->m_right = std::move(other.m_right);
+        else
+          this->m_left = std::move(other.m_left);
+        return *this;
+      }
+
+      // explicit deletion, then placement new
+      Held<L, R>::destroy(*this);
+      Held<L, R>::construct(*this, std::move(other));
+      return *this;
+    }
+  };
+}
+
+//------------------------------------------------------------------------------
+// The either monad
+
+template <typename Left, typename Right,
+          typename TagPolicy = either::DefaultTag<Left, Right>>
+struct Either : public either::Storage<Left, Right, TagPolicy>
+{
+  using L = Left;
+  using R = Right;
+  using Policy = TagPolicy;
+
+  // copy construct from a right value
+  explicit Either(const R& r)
+    noexcept(std::is_nothrow_copy_constructible<R>())
+    : either::Storage<L, R, Policy>(either::RightTag(), r)
+  {}
+
+  // move construct from a right value
+  explicit Either(R&& r)
+    noexcept(std::is_nothrow_move_constructible<R>())
+    : either::Storage<L, R, Policy>(either::RightTag(), std::move(r))
+  {}
+
+  // copy construct from a left value
+  Either(const L& l, bool)
+    noexcept(std::is_nothrow_copy_constructible<L>())
+    : either::Storage<L, R, Policy>(either::LeftTag(), l)
+  {}
+
+  // move construct from a left value
+  Either(L&& l, bool)
+    noexcept(std::is_nothrow_move_constructible<L>())
+    : either::Storage<L, R, Policy>(either::LeftTag(), std::move(l))
+  {}
 };
 
 //------------------------------------------------------------------------------
 // equality
 
-template<typename L, typename R>
-bool operator==(const Either<L, R>& a, const Either<L, R>& b)
+template<typename L, typename R, typename P>
+bool operator==(const Either<L, R, P>& a, const Either<L, R, P>& b)
 {
   return a.isRight() == b.isRight()
     && (a.isRight()
@@ -157,8 +379,8 @@ bool operator==(const Either<L, R>& a, const Either<L, R>& b)
         : a.m_left == b.m_left);
 }
 
-template<typename L, typename R>
-bool operator!=(const Either<L, R>& a, const Either<L, R>& b)
+template<typename L, typename R, typename P>
+bool operator!=(const Either<L, R, P>& a, const Either<L, R, P>& b)
 {
   return !(a == b);
 }
@@ -168,10 +390,10 @@ bool operator!=(const Either<L, R>& a, const Either<L, R>& b)
 
 namespace either
 {
-  template <typename A, typename F>
+  template <typename A, typename F, typename P>
   inline Either<A, typename function_traits<F>::returnType> fmap(
       const F& f,
-      const Either<A, typename function_traits<F>::template Arg<0>::bareType>& e)
+      const Either<A, typename function_traits<F>::template Arg<0>::bareType, P>& e)
   {
     using C = typename function_traits<F>::returnType;
 
@@ -180,18 +402,44 @@ namespace either
     return Either<A, C>(f(e.m_right));
   }
 
-  template <typename A, typename F>
+  // rvalue fmap: steal whichever payload is present
+  template <typename A, typename F, typename P>
+  inline Either<A, typename function_traits<F>::returnType> fmap(
+      const F& f,
+      Either<A, typename function_traits<F>::template Arg<0>::bareType, P>&& e)
+  {
+    using C = typename function_traits<F>::returnType;
+
+    if (!e.isRight())
+      return Either<A, C>(std::move(e.m_left), true);
+    return Either<A, C>(f(std::move(e.m_right)));
+  }
+
+  template <typename A, typename F, typename P>
   inline typename function_traits<F>::returnType bind(
       const F& f,
-      const Either<A, typename function_traits<F>::template Arg<0>::bareType>& e)
+      const Either<A, typename function_traits<F>::template Arg<0>::bareType, P>& e)
   {
     using C = typename function_traits<F>::returnType;
 
     if (!e.isRight())
-      return Either<A, C>(e.m_left, true);
+      return C(e.m_left, true);
     return f(e.m_right);
   }
 
+  // rvalue bind: steal whichever payload is present
+  template <typename A, typename F, typename P>
+  inline typename function_traits<F>::returnType bind(
+      const F& f,
+      Either<A, typename function_traits<F>::template Arg<0>::bareType, P>&& e)
+  {
+    using C = typename function_traits<F>::returnType;
+
+    if (!e.isRight())
+      return C(std::move(e.m_left), true);
+    return f(std::move(e.m_right));
+  }
+
   template <typename A, typename B>
   inline Either<A, B> pure(B&& b)
   {
@@ -199,26 +447,76 @@ namespace either
   }
 }
 
+//------------------------------------------------------------------------------
+// traversable functions: apply a function returning Either to each element of
+// a range, producing either the first Left or a vector of all the Rights.
+
+namespace either
+{
+  // The Either returned by F for an element of Range
+  template <typename F, typename Range>
+  using TraverseResultT = std::decay_t<decltype(
+      std::declval<const F&>()(*std::begin(std::declval<const Range&>())))>;
+
+  template <typename It, typename V>
+  inline void reserveFor(It first, It last, std::vector<V>& v, std::random_access_iterator_tag)
+  {
+    v.reserve(static_cast<std::size_t>(last - first));
+  }
+
+  template <typename It, typename V, typename Tag>
+  inline void reserveFor(It, It, std::vector<V>&, Tag)
+  {}
+
+  // [a] -> (a -> Either e b) -> Either e [b]
+  template <typename Range, typename F,
+            typename EB = TraverseResultT<F, Range>,
+            typename E = typename EB::L,
+            typename B = typename EB::R>
+  inline Either<E, std::vector<B>> traverse(const Range& range, const F& f)
+  {
+    std::vector<B> result;
+    auto first = std::begin(range);
+    auto last = std::end(range);
+    reserveFor(first, last, result,
+               typename std::iterator_traits<decltype(first)>::iterator_category());
+
+    for (; first != last; ++first)
+    {
+      EB e = f(*first);
+      if (!e.isRight())
+        return Either<E, std::vector<B>>(std::move(e.m_left), true);
+      result.push_back(std::move(e.m_right));
+    }
+    return Either<E, std::vector<B>>(std::move(result));
+  }
+
+  // [Either e b] -> Either e [b]
+  template <typename Range>
+  inline auto sequence(const Range& range)
+  {
+    return traverse(range, [] (const auto& e) { return e; });
+  }
+}
+
 //------------------------------------------------------------------------------
 // sugar operators
 
-template <typename A, typename F>
+template <typename A, typename F, typename P>
 inline typename function_traits<F>::returnType operator>=(
-    Either<A, typename function_traits<F>::template Arg<0>::bareType>&& e,
+    Either<A, typename function_traits<F>::template Arg<0>::bareType, P>&& e,
     F&& f)
 {
-  return either::bind(
-      std::forward<F>(f),
-      std::forward<Either<A, typename function_traits<F>::template Arg<0>::bareType>>(e));
+  return either::bind(std::forward<F>(f), std::move(e));
 }
 
-template <typename A, typename B, typename F>
+template <typename A, typename B, typename P, typename F>
 inline typename function_traits<F>::returnType operator>(
-    Either<A,B>&& e, const F& f)
+    Either<A, B, P>&& e, const F& f)
 {
   using C = typename function_traits<F>::returnType;
 
   if (!e.isRight())
-    return Either<A, C>(std::forward<A>(e.m_left), true);
+    return C(std::move(e.m_left), true);
   return f();
 }
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "either.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Parallel traverse over a random-access range, on an executor (anything with
+// post(UniqueFunction<void ()>) and size(), such as async::ThreadPool):
+//
+//   auto r = either::traverse(pool, inputs, validate);
+//
+// The range is cut into chunks, which the calling thread and up to size()
+// tasks on the executor claim in index order. A Left stops the work: chunks
+// after it are skipped, and elements after it within a chunk aren't visited.
+// Chunks before it still run, since one of them may hold an earlier Left, so
+// the result is the same as the sequential traverse: the first Left in index
+// order, or all the Rights.
+//
+// The calling thread works on chunks too, and waits only for chunks already
+// claimed, so this can be called from one of the executor's own workers.
+//
+// When the results can be default-constructed and assigned, each chunk writes
+// its range of a vector sized up front, which becomes the result as it is.
+// Otherwise a vector can't leave a gap for a chunk that hasn't run, so each
+// chunk fills its own vector and they're moved into the result at the end: a
+// second copy of the results at the peak, and a pass over them. (vector<bool>
+// packs its elements, so chunks can't write it concurrently; bools take the
+// second way too.)
+
+namespace either
+{
+  // Where the chunks put their results
+  template <typename B,
+            bool = std::is_default_constructible<B>::value
+                   && std::is_move_assignable<B>::value
+                   && !std::is_same<B, bool>::value>
+  class TraverseOutput
+  {
+  public:
+    TraverseOutput(std::size_t n, std::size_t)
+      : m_results(n)
+    {}
+
+    void reserve(std::size_t, std::size_t) {}
+
+    void set(std::size_t, std::size_t i, B&& b) { m_results[i] = std::move(b); }
+
+    std::vector<B> take() { return std::move(m_results); }
+
+  private:
+    std::vector<B> m_results;
+  };
+
+  template <typename B>
+  class TraverseOutput<B, false>
+  {
+  public:
+    TraverseOutput(std::size_t n, std::size_t chunks)
+      : m_size(n)
+      , m_results(chunks)
+    {}
+
+    void reserve(std::size_t c, std::size_t n) { m_results[c].reserve(n); }
+
+    void set(std::size_t c, std::size_t, B&& b) { m_results[c].push_back(std::move(b)); }
+
+    std::vector<B> take()
+    {
+      std::vector<B> result;
+      result.reserve(m_size);
+      for (auto& r : m_results)
+        std::move(r.begin(), r.end(), std::back_inserter(result));
+      return result;
+    }
+
+  private:
+    std::size_t m_size;
+    std::vector<std::vector<B>> m_results;
+  };
+
+  template <typename It, typename F, typename E, typename B>
+  class TraverseState
+  {
+  public:
+    TraverseState(It first, std::size_t n, std::size_t grain, const F& f)
+      : m_first(first)
+      , m_size(n)
+      , m_grain(grain)
+      , m_chunks((n + grain - 1) / grain)
+      , m_results(n, m_chunks)
+      , m_f(&f)
+    {}
+
+    // Claim and process chunks until there are none left.
+    void work()
+    {
+      for (;;)
+      {
+        std::size_t c = m_nextChunk.fetch_add(1, std::memory_order_relaxed);
+        if (c >= m_chunks)
+          return;
+        process(c);
+        if (m_chunksDone.fetch_add(1, std::memory_order_acq_rel) + 1 == m_chunks)
+        {
+          std::lock_guard<std::mutex> g(m_mutex);
+          m_done.notify_all();
+        }
+      }
+    }
+
+    void wait()
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_done.wait(lock, [this] {
+          return m_chunksDone.load(std::memory_order_acquire) == m_chunks; });
+    }
+
+    std::size_t chunks() const { return m_chunks; }
+
+    Either<E, std::vector<B>> result()
+    {
+      if (m_left)
+        return Either<E, std::vector<B>>(std::move(*m_left), true);
+
+      return Either<E, std::vector<B>>(m_results.take());
+    }
+
+  private:
+    void process(std::size_t c)
+    {
+      std::size_t begin = c * m_grain;
+      std::size_t end = std::min(begin + m_grain, m_size);
+
+      // skip the chunk outright if it's after a Left
+      if (begin > m_firstLeft.load(std::memory_order_relaxed))
+        return;
+
+      m_results.reserve(c, end - begin);
+      It it = m_first + static_cast<std::ptrdiff_t>(begin);
+      for (std::size_t i = begin; i < end; ++i, ++it)
+      {
+        auto e = (*m_f)(*it);
+        if (!e.isRight())
+        {
+          setLeft(i, std::move(e.m_left));
+          return;
+        }
+        m_results.set(c, i, std::move(e.m_right));
+
+        // every so often, check whether an earlier Left has been found
+        if ((i & 63) == 0 && i > m_firstLeft.load(std::memory_order_relaxed))
+          return;
+      }
+    }
+
+    void setLeft(std::size_t i, E&& e)
+    {
+      std::lock_guard<std::mutex> g(m_mutex);
+      if (i < m_firstLeft.load(std::memory_order_relaxed))
+      {
+        m_firstLeft.store(i, std::memory_order_relaxed);
+        m_left = std::make_unique<E>(std::move(e));
+      }
+    }
+
+    It m_first;
+    std::size_t m_size;
+    std::size_t m_grain;
+    std::size_t m_chunks;
+    TraverseOutput<B> m_results;
+    const F* m_f;
+
+    std::atomic<std::size_t> m_nextChunk{0};
+    std::atomic<std::size_t> m_chunksDone{0};
+    std::atomic<std::size_t> m_firstLeft{std::numeric_limits<std::size_t>::max()};
+    std::unique_ptr<E> m_left;
+
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+  };
+
+  // [a] -> (a -> Either e b) -> Either e [b], in parallel. grain is the
+  // number of elements in a chunk; by default, enough for a few chunks per
+  // thread.
+  template <typename Executor, typename Range, typename F,
+            typename EB = TraverseResultT<F, Range>,
+            typename E = typename EB::L,
+            typename B = typename EB::R>
+  inline Either<E, std::vector<B>> traverse(
+      Executor& ex, const Range& range, const F& f, std::size_t grain = 0)
+  {
+    auto first = std::begin(range);
+    std::size_t n = static_cast<std::size_t>(std::end(range) - first);
+    if (n == 0)
+      return Either<E, std::vector<B>>(std::vector<B>());
+    if (grain == 0)
+      grain = std::max<std::size_t>(n / (4 * (ex.size() + 1)), 1024);
+
+    using State = TraverseState<decltype(first), F, E, B>;
+    auto pState = std::make_shared<State>(first, n, grain, f);
+
+    // helpers which start late find no chunks left, and only touch the
+    // shared state
+    std::size_t helpers = std::min(ex.size(), pState->chunks() - 1);
+    for (std::size_t i = 0; i < helpers; ++i)
+      ex.post([pState] { pState->work(); });
+
+    pState->work();
+    pState->wait();
+    return pState->result();
+  }
+}
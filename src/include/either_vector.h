@@ -0,0 +1,316 @@
+#pragma once
+
+#include "either.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A sequence of Either<L, R> stored as structure-of-arrays: a bitmap of tags
+// (a set bit is a Right) and dense arrays of the Left and Right values, in
+// order. Counting either side is free, and scans over one side touch only
+// that side's array.
+//
+// Element i lives at index rank(i) in the rights, or i - rank(i) in the
+// lefts, where rank(i) is the number of Rights before it. A directory holding
+// the rank at the start of each bitmap word makes that a lookup and a
+// popcount.
+
+template <typename L, typename R>
+class EitherVector
+{
+  using Word = std::uint64_t;
+  static constexpr std::size_t s_wordBits = 64;
+
+public:
+  // An Either-like reference to an element
+  template <typename LRef, typename RRef>
+  class Reference
+  {
+  public:
+    Reference(bool right, LRef* l, RRef* r)
+      : m_isRight(right), m_left(l), m_right(r)
+    {}
+
+    bool isRight() const { return m_isRight; }
+
+    // Precondition: !isRight()
+    LRef& left() const { return *m_left; }
+
+    // Precondition: isRight()
+    RRef& right() const { return *m_right; }
+
+    operator Either<L, R>() const
+    {
+      return m_isRight ? Either<L, R>(*m_right) : Either<L, R>(*m_left, true);
+    }
+
+  private:
+    bool m_isRight;
+    LRef* m_left;
+    RRef* m_right;
+  };
+
+  using reference = Reference<L, R>;
+  using const_reference = Reference<const L, const R>;
+
+  // Iterators keep track of their position in each array, so stepping
+  // through the container costs a bit test.
+  template <typename V, typename Ref>
+  class Iterator
+  {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Either<L, R>;
+    using difference_type = std::ptrdiff_t;
+    using reference = Ref;
+    using pointer = void;
+
+    Iterator(V* v, std::size_t i, std::size_t nRight)
+      : m_v(v), m_index(i), m_nRight(nRight)
+    {}
+
+    Ref operator*() const
+    {
+      return m_v->at(m_index, m_nRight);
+    }
+
+    Iterator& operator++()
+    {
+      m_nRight += m_v->isRight(m_index);
+      ++m_index;
+      return *this;
+    }
+
+    Iterator operator++(int)
+    {
+      Iterator i = *this;
+      ++*this;
+      return i;
+    }
+
+    bool operator==(const Iterator& other) const { return m_index == other.m_index; }
+    bool operator!=(const Iterator& other) const { return m_index != other.m_index; }
+
+  private:
+    V* m_v;
+    std::size_t m_index;
+    std::size_t m_nRight;
+  };
+
+  using iterator = Iterator<EitherVector, reference>;
+  using const_iterator = Iterator<const EitherVector, const_reference>;
+
+  EitherVector() = default;
+
+  std::size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+
+  void reserve(std::size_t n)
+  {
+    m_tags.reserve((n + s_wordBits - 1) / s_wordBits);
+    m_ranks.reserve((n + s_wordBits - 1) / s_wordBits);
+  }
+
+  void clear()
+  {
+    m_tags.clear();
+    m_ranks.clear();
+    m_lefts.clear();
+    m_rights.clear();
+    m_size = 0;
+  }
+
+  template <typename... Args>
+  void emplace_left(Args&&... args)
+  {
+    m_lefts.emplace_back(std::forward<Args>(args)...);
+    pushTag(false);
+  }
+
+  template <typename... Args>
+  void emplace_right(Args&&... args)
+  {
+    m_rights.emplace_back(std::forward<Args>(args)...);
+    pushTag(true);
+  }
+
+  template <typename P>
+  void push_back(const Either<L, R, P>& e)
+  {
+    if (e.isRight())
+      emplace_right(e.m_right);
+    else
+      emplace_left(e.m_left);
+  }
+
+  template <typename P>
+  void push_back(Either<L, R, P>&& e)
+  {
+    if (e.isRight())
+      emplace_right(std::move(e.m_right));
+    else
+      emplace_left(std::move(e.m_left));
+  }
+
+  bool isRight(std::size_t i) const
+  {
+    return (m_tags[i / s_wordBits] >> (i % s_wordBits)) & 1;
+  }
+
+  // The number of Rights before element i
+  std::size_t rank(std::size_t i) const
+  {
+    Word below = m_tags[i / s_wordBits] & ((Word(1) << (i % s_wordBits)) - 1);
+    return m_ranks[i / s_wordBits] + __builtin_popcountll(below);
+  }
+
+  reference operator[](std::size_t i) { return at(i, rank(i)); }
+  const_reference operator[](std::size_t i) const { return at(i, rank(i)); }
+
+  iterator begin() { return iterator(this, 0, 0); }
+  iterator end() { return iterator(this, m_size, m_rights.size()); }
+  const_iterator begin() const { return const_iterator(this, 0, 0); }
+  const_iterator end() const { return const_iterator(this, m_size, m_rights.size()); }
+
+  std::size_t countLeft() const { return m_lefts.size(); }
+  std::size_t countRight() const { return m_rights.size(); }
+
+  // The dense arrays, in element order
+  const std::vector<L>& lefts() const { return m_lefts; }
+  const std::vector<R>& rights() const { return m_rights; }
+
+  // The tag bitmap: bit i % 64 of word i / 64 is set if element i is a
+  // Right. Bits past the last element are clear.
+  const std::vector<std::uint64_t>& tags() const { return m_tags; }
+
+  // Apply a function to every Right. The Lefts are carried over untouched.
+  template <typename F, typename B = typename function_traits<F>::returnType>
+  EitherVector<L, B> fmap(const F& f) const &
+  {
+    EitherVector<L, B> result = withTagsOf<B>(*this);
+    result.m_lefts = m_lefts;
+    mapRights(f, result);
+    return result;
+  }
+
+  template <typename F, typename B = typename function_traits<F>::returnType>
+  EitherVector<L, B> fmap(const F& f) &&
+  {
+    EitherVector<L, B> result = withTagsOf<B>(*this);
+    result.m_lefts = std::move(m_lefts);
+    mapRights(f, result);
+    clear();
+    return result;
+  }
+
+  // Split into the Lefts and the Rights.
+  std::pair<std::vector<L>, std::vector<R>> partition() const &
+  {
+    return { m_lefts, m_rights };
+  }
+
+  std::pair<std::vector<L>, std::vector<R>> partition() &&
+  {
+    std::pair<std::vector<L>, std::vector<R>> result(
+        std::move(m_lefts), std::move(m_rights));
+    clear();
+    return result;
+  }
+
+private:
+  template <typename, typename>
+  friend class EitherVector;
+
+  void pushTag(bool right)
+  {
+    std::size_t bit = m_size % s_wordBits;
+    if (bit == 0)
+    {
+      // the rank directory records the Rights before each word
+      m_ranks.push_back(m_rights.size() - right);
+      m_tags.push_back(0);
+    }
+    m_tags.back() |= Word(right) << bit;
+    ++m_size;
+  }
+
+  reference at(std::size_t i, std::size_t nRight)
+  {
+    return isRight(i)
+      ? reference(true, nullptr, &m_rights[nRight])
+      : reference(false, &m_lefts[i - nRight], nullptr);
+  }
+
+  const_reference at(std::size_t i, std::size_t nRight) const
+  {
+    return isRight(i)
+      ? const_reference(true, nullptr, &m_rights[nRight])
+      : const_reference(false, &m_lefts[i - nRight], nullptr);
+  }
+
+  template <typename B>
+  static EitherVector<L, B> withTagsOf(const EitherVector& v)
+  {
+    EitherVector<L, B> result;
+    result.m_tags = v.m_tags;
+    result.m_ranks = v.m_ranks;
+    result.m_size = v.m_size;
+    return result;
+  }
+
+  template <typename F, typename B>
+  void mapRights(const F& f, EitherVector<L, B>& result)
+  {
+    result.m_rights.reserve(m_rights.size());
+    for (auto& r : m_rights)
+      result.m_rights.push_back(f(std::move(r)));
+  }
+
+  template <typename F, typename B>
+  void mapRights(const F& f, EitherVector<L, B>& result) const
+  {
+    result.m_rights.reserve(m_rights.size());
+    for (const auto& r : m_rights)
+      result.m_rights.push_back(f(r));
+  }
+
+  std::vector<Word> m_tags;
+  std::vector<std::size_t> m_ranks;
+  std::vector<L> m_lefts;
+  std::vector<R> m_rights;
+  std::size_t m_size = 0;
+};
+
+//------------------------------------------------------------------------------
+// bulk functor functions
+
+namespace either
+{
+  template <typename F, typename L, typename R>
+  inline auto fmap(const F& f, const EitherVector<L, R>& v)
+  {
+    return v.fmap(f);
+  }
+
+  template <typename F, typename L, typename R>
+  inline auto fmap(const F& f, EitherVector<L, R>&& v)
+  {
+    return std::move(v).fmap(f);
+  }
+
+  template <typename L, typename R>
+  inline std::pair<std::vector<L>, std::vector<R>> partition(const EitherVector<L, R>& v)
+  {
+    return v.partition();
+  }
+
+  template <typename L, typename R>
+  inline std::pair<std::vector<L>, std::vector<R>> partition(EitherVector<L, R>&& v)
+  {
+    return std::move(v).partition();
+  }
+}
@@ -0,0 +1,429 @@
+#pragma once
+
+#include "async.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+// An epoll event loop, run by a single thread, which completes reads and
+// writes on non-blocking file descriptors. An operation first tries its system
+// call on the calling thread, and completes there if it can. Otherwise it
+// parks in the fd's slot until epoll says the fd is ready, and is retried (and
+// completes) on the loop's thread.
+//
+// Each fd has a slot, made the first time the fd has to wait, holding at most
+// one waiting reader and one waiting writer. The slot stores the operation
+// itself (its buffer and continuation), so parking allocates nothing. A second
+// operation in the same direction while one is waiting fails with EBUSY. A
+// waiting operation is dropped (its continuation never called) if the current
+// cancellation when it was started is cancelled.
+//
+// fds are registered edge-triggered, once; the slot remembers an edge which
+// arrives with nothing waiting, so that it isn't lost. Before closing an fd
+// which has been used with the loop, call forget(fd).
+//
+// Writing to a pipe or socket whose reader has gone raises SIGPIPE; ignore it
+// to get EPIPE instead. See async_io.h for the Asyncs which use the loop.
+
+namespace async
+{
+  // The result of a read or write: the bytes transferred (0 from a read
+  // means end of file), or the error
+  using IoResult = Either<std::error_code, std::size_t>;
+
+  // Whether C is a contiguous container whose data() converts to P: such as a
+  // std::vector<char>, or for reading from, a std::string (whose data() is
+  // const before C++17)
+  template <typename C, typename P, typename = void>
+  struct IsBufferSource : std::false_type {};
+
+  template <typename C, typename P>
+  struct IsBufferSource<C, P, std::enable_if_t<
+    std::is_convertible<decltype(std::declval<C&>().data()), P>::value
+    && std::is_convertible<decltype(std::declval<C&>().size()), std::size_t>::value>>
+    : std::true_type {};
+
+  // Views of bytes to read into or write from (std::span needs C++20)
+  struct MutableBuffer
+  {
+    MutableBuffer(void* d, std::size_t n)
+      : data(static_cast<char*>(d)), size(n)
+    {}
+
+    // from a contiguous container with mutable data
+    template <typename C,
+              // constraint: C's data() must be mutable (which also keeps this
+              // from hijacking the copy constructor)
+              std::enable_if_t<IsBufferSource<C, void*>::value, int> = 0>
+    MutableBuffer(C& c)
+      : data(static_cast<char*>(static_cast<void*>(c.data()))), size(c.size())
+    {}
+
+    char* data;
+    std::size_t size;
+  };
+
+  struct ConstBuffer
+  {
+    ConstBuffer(const void* d, std::size_t n)
+      : data(static_cast<const char*>(d)), size(n)
+    {}
+
+    ConstBuffer(const MutableBuffer& b)
+      : data(b.data), size(b.size)
+    {}
+
+    template <typename C,
+              // constraint: C must be a container, not a buffer
+              std::enable_if_t<IsBufferSource<const C, const void*>::value, int> = 0>
+    ConstBuffer(const C& c)
+      : data(static_cast<const char*>(static_cast<const void*>(c.data()))), size(c.size())
+    {}
+
+    const char* data;
+    std::size_t size;
+  };
+
+  class EventLoop
+  {
+  public:
+    EventLoop()
+      : m_epoll(::epoll_create1(EPOLL_CLOEXEC))
+      , m_wake(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    {
+      if (m_epoll < 0 || m_wake < 0)
+        throw std::system_error(errno, std::system_category(), "EventLoop");
+      epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.fd = m_wake;
+      ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &ev);
+      m_thread = std::thread([this] { run(); });
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Operations still waiting are dropped, and their cancellation callbacks
+    // removed. (A callback already running on another thread isn't waited
+    // for: don't destroy a loop while cancelling its operations.)
+    ~EventLoop()
+    {
+      m_stop.store(true, std::memory_order_release);
+      std::uint64_t one = 1;
+      ssize_t n = ::write(m_wake, &one, sizeof(one));
+      (void)n;
+      m_thread.join();
+      for (auto& s : m_slots)
+        if (s)
+          for (auto& op : s->waiting)
+            op.registration.remove();
+      ::close(m_wake);
+      ::close(m_epoll);
+    }
+
+    // Call cont once fd may be readable (as with epoll, a read may still find
+    // nothing).
+    void startReadable(int fd, ContinuationT<void> cont)
+    {
+      Op op;
+      op.kind = Op::READABLE;
+      op.ready = std::move(cont);
+      if (!park(fd, READ, op))
+      {
+        op.registration.remove();
+        op.ready();
+      }
+    }
+
+    // Read up to b.size bytes, once there are any.
+    void startRead(int fd, MutableBuffer b, ContinuationT<IoResult> cont)
+    {
+      Op op;
+      op.kind = Op::READ;
+      op.data = b.data;
+      op.size = b.size;
+      op.cont = std::move(cont);
+      attempt(fd, op);
+    }
+
+    // Write all of b.
+    void startWrite(int fd, ConstBuffer b, ContinuationT<IoResult> cont)
+    {
+      Op op;
+      op.kind = Op::WRITE;
+      op.data = const_cast<char*>(b.data);
+      op.size = b.size;
+      op.cont = std::move(cont);
+      attempt(fd, op);
+    }
+
+    // Stop watching an fd (before closing it). Its waiting operations are
+    // dropped.
+    void forget(int fd)
+    {
+      Op dropped[2];
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (fd < 0 || static_cast<std::size_t>(fd) >= m_slots.size() || !m_slots[fd])
+          return;
+        Slot& s = *m_slots[fd];
+        ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        for (int d = 0; d < 2; ++d)
+          dropped[d] = std::move(s.waiting[d]);
+        m_slots[fd].reset();
+      }
+      for (auto& op : dropped)
+        op.registration.remove();
+    }
+
+  private:
+    enum Direction { READ, WRITE };
+
+    // A waiting operation
+    struct Op
+    {
+      enum Kind { NONE, READABLE, READ, WRITE };
+
+      Kind kind = NONE;
+      char* data = nullptr;
+      std::size_t size = 0;
+      std::size_t done = 0;          // bytes written so far
+      std::uint64_t generation = 0;  // identifies it, to cancel it
+      ContinuationT<void> ready;
+      ContinuationT<IoResult> cont;
+      CancellationRegistration registration;
+    };
+
+    struct Slot
+    {
+      Op waiting[2];
+      bool ready[2] = {false, false};  // an edge arrived with nothing waiting
+    };
+
+    static IoResult error(int e)
+    {
+      return IoResult(std::error_code(e, std::system_category()), true);
+    }
+
+    // An operation is done with its cancellation once it completes
+    static void complete(Op& op, IoResult r)
+    {
+      op.registration.remove();
+      op.cont(std::move(r));
+    }
+
+    // Make the system calls until the operation completes or has to wait.
+    void attempt(int fd, Op& op)
+    {
+      for (;;)
+      {
+        ssize_t n = op.kind == Op::READ
+          ? ::read(fd, op.data, op.size)
+          : ::write(fd, op.data + op.done, op.size - op.done);
+        if (n >= 0)
+        {
+          if (op.kind == Op::WRITE)
+          {
+            op.done += static_cast<std::size_t>(n);
+            if (op.done < op.size)
+              continue;
+          }
+          complete(op, IoResult(op.kind == Op::READ ? static_cast<std::size_t>(n) : op.done));
+          return;
+        }
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+          complete(op, error(errno));
+          return;
+        }
+        if (park(fd, op.kind == Op::READ ? READ : WRITE, op))
+          return;
+      }
+    }
+
+    // Leave an operation in the fd's slot. Returns true if it's waiting, or
+    // has completed with an error because it can't wait, or has been dropped;
+    // false if the fd has become ready since it last tried (or it's a
+    // readable() which can't wait), so that the caller carries on with it.
+    bool park(int fd, Direction d, Op& op)
+    {
+      // when it first waits (a retry from the loop is already registered),
+      // register to drop it with the current cancellation, before it can be
+      // resumed, so that its registration is there to remove when it completes
+      const CancellationToken& t = currentCancellation();
+      std::uint64_t gen = op.generation;
+      if (gen == 0 && t.canBeCancelled())
+      {
+        gen = op.generation = m_generation.fetch_add(1, std::memory_order_relaxed) + 1;
+        op.registration = t.onCancel([this, fd, d, gen] { drop(fd, d, gen); });
+        if (t.isCancelled())
+        {
+          op.registration.remove();
+          return true;
+        }
+      }
+
+      int failed = 0;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        Slot* s = slot(fd, failed);
+        if (s && s->ready[d])
+        {
+          s->ready[d] = false;
+          return false;
+        }
+        if (s && s->waiting[d].kind != Op::NONE)
+          failed = EBUSY;
+        if (!failed)
+          s->waiting[d] = std::move(op);
+      }
+
+      if (failed)
+      {
+        // a readable() which can't wait reports readiness: a read will tell
+        if (op.kind == Op::READABLE)
+          return false;
+        complete(op, error(failed));
+        return true;
+      }
+
+      // cancelled while it was being parked: the callback found nothing
+      if (gen != 0 && t.isCancelled())
+        drop(fd, d, gen);
+      return true;
+    }
+
+    // The fd's slot, made and registered with epoll if need be
+    Slot* slot(int fd, int& failed)
+    {
+      if (fd < 0)
+      {
+        failed = EBADF;
+        return nullptr;
+      }
+      if (static_cast<std::size_t>(fd) >= m_slots.size())
+        m_slots.resize(fd + 1);
+      if (!m_slots[fd])
+      {
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+        {
+          failed = errno;
+          return nullptr;
+        }
+        m_slots[fd] = std::make_unique<Slot>();
+      }
+      return m_slots[fd].get();
+    }
+
+    void drop(int fd, Direction d, std::uint64_t gen)
+    {
+      Op dropped;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (static_cast<std::size_t>(fd) < m_slots.size() && m_slots[fd]
+            && m_slots[fd]->waiting[d].generation == gen)
+        {
+          dropped = std::move(m_slots[fd]->waiting[d]);
+          m_slots[fd]->waiting[d].kind = Op::NONE;
+          m_slots[fd]->waiting[d].generation = 0;
+        }
+      }
+      dropped.registration.remove();
+    }
+
+    // Take the waiting operations which the events make ready (or note the
+    // readiness) and resume them.
+    void dispatch(int fd, std::uint32_t events)
+    {
+      const std::uint32_t masks[2] = {
+        EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR,
+        EPOLLOUT | EPOLLHUP | EPOLLERR };
+
+      Op ops[2];
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (static_cast<std::size_t>(fd) >= m_slots.size() || !m_slots[fd])
+          return;
+        Slot& s = *m_slots[fd];
+        for (int d = 0; d < 2; ++d)
+        {
+          if (!(events & masks[d]))
+            continue;
+          if (s.waiting[d].kind == Op::NONE)
+            s.ready[d] = true;
+          else
+          {
+            ops[d] = std::move(s.waiting[d]);
+            s.waiting[d].kind = Op::NONE;
+            s.waiting[d].generation = 0;
+          }
+        }
+      }
+
+      for (auto& op : ops)
+      {
+        if (op.kind == Op::READABLE)
+        {
+          op.registration.remove();
+          op.ready();
+        }
+        else if (op.kind != Op::NONE)
+          attempt(fd, op);
+      }
+    }
+
+    void run()
+    {
+      epoll_event events[64];
+      for (;;)
+      {
+        int n = ::epoll_wait(m_epoll, events, 64, -1);
+        if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+          if (events[i].data.fd == m_wake)
+          {
+            if (m_stop.load(std::memory_order_acquire))
+              return;
+            continue;
+          }
+          dispatch(events[i].data.fd, events[i].events);
+        }
+      }
+    }
+
+    const int m_epoll;
+    const int m_wake;
+    std::atomic<bool> m_stop{false};
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Slot>> m_slots;  // indexed by fd
+    std::atomic<std::uint64_t> m_generation{0};
+
+    std::thread m_thread;
+  };
+}
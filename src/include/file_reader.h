@@ -0,0 +1,720 @@
+#pragma once
+
+#include "allocator.h"
+#include "async.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+// Readers of byte ranges of files. A FileReader opens a file, reads up to len
+// bytes from an offset and closes it again, then calls a continuation with
+// the bytes (fewer at end of file) or the error. See async_file.h for the
+// Asyncs which use it.
+//
+// UringFileReader does all three with io_uring, on a thread of its own which
+// owns the ring. Reads started while the thread is busy are queued, and the
+// thread submits everything queued with a single system call, so a fan-out of
+// reads costs a few system calls in all rather than three per read. Each read
+// goes straight into the buffer handed to the continuation: a registered
+// buffer from the reader's pool if len fits in one and one is free (the kernel
+// then needn't map it for every read), otherwise one allocated for the read.
+// Continuations run on the reader's thread, so they should be short: move
+// longer work elsewhere with schedule_on.
+//
+// PreadFileReader is the fallback, for when io_uring is unavailable (an old
+// kernel, or a seccomp policy which blocks it): each read is a task on a
+// ThreadPool making blocking system calls. makeFileReader() picks whichever
+// works.
+//
+// A read whose cancellation (the current one when it was started) is
+// cancelled before it completes is dropped. Reads still in progress when a
+// reader is destroyed are dropped too; their buffers are freed once the kernel
+// is done with them.
+//
+// If io_uring_enter fails with an error which retrying won't help, the ring is
+// given up: the reads in progress, and every read started after, fail with
+// that error.
+
+namespace async
+{
+  //----------------------------------------------------------------------------
+  // Bytes read from a file. Copying a FileBuffer shares the bytes rather than
+  // copying them; they're freed (or returned to their pool) with the last
+  // copy, which may outlive the reader.
+  class FileBuffer
+  {
+  public:
+    FileBuffer() = default;
+
+    FileBuffer(std::shared_ptr<const void> owner, const char* data, std::size_t size)
+      : m_owner(std::move(owner)), m_data(data), m_size(size)
+    {}
+
+    const char* data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    const char* begin() const { return m_data; }
+    const char* end() const { return m_data + m_size; }
+
+  private:
+    std::shared_ptr<const void> m_owner;
+    const char* m_data = nullptr;
+    std::size_t m_size = 0;
+  };
+
+  using FileResult = Either<std::error_code, FileBuffer>;
+
+  class FileReader
+  {
+  public:
+    virtual ~FileReader() = default;
+
+    // Read up to len bytes of the file at path, from offset.
+    virtual void startRead(const std::string& path, std::uint64_t offset,
+                           std::size_t len, ContinuationT<FileResult> cont) = 0;
+
+    virtual const char* name() const = 0;
+
+  protected:
+    static FileResult error(int e)
+    {
+      return FileResult(std::error_code(e, std::system_category()), true);
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  class PreadFileReader : public FileReader
+  {
+  public:
+    explicit PreadFileReader(std::size_t threads = ThreadPool::defaultSize())
+      : m_pool(threads)
+    {}
+
+    void startRead(const std::string& path, std::uint64_t offset,
+                   std::size_t len, ContinuationT<FileResult> cont) override
+    {
+      CancellationToken t = currentCancellation();
+      if (t.isCancelled())
+        return;
+      m_pool.post([path, offset, len, c = std::move(cont), t = std::move(t)] () mutable {
+          if (t.isCancelled())
+            return;
+          FileResult r = read(path, offset, len);
+          if (!t.isCancelled())
+            c(std::move(r));
+        });
+    }
+
+    const char* name() const override { return "pread"; }
+
+  private:
+    struct Bytes
+    {
+      explicit Bytes(std::size_t n) : data(new char[n]) {}
+      std::unique_ptr<char[]> data;
+    };
+
+    static FileResult read(const std::string& path, std::uint64_t offset, std::size_t len)
+    {
+      int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        return error(errno);
+
+      auto bytes = allocateShared<Bytes>(len);
+      std::size_t done = 0;
+      int failed = 0;
+      while (done < len)
+      {
+        ssize_t n = ::pread(fd, bytes->data.get() + done, len - done,
+                            static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0)
+          failed = errno;
+        if (n <= 0)
+          break;
+        done += static_cast<std::size_t>(n);
+      }
+      ::close(fd);
+
+      if (failed)
+        return error(failed);
+      const char* data = bytes->data.get();
+      return FileResult(FileBuffer(std::move(bytes), data, done));
+    }
+
+    ThreadPool m_pool;
+  };
+
+  //----------------------------------------------------------------------------
+  class UringFileReader : public FileReader
+  {
+  public:
+    // The ring has room for entries operations at once (reads beyond that
+    // wait their turn). buffers registered buffers of bufferSize bytes each
+    // are set aside for reads which fit in one; if they can't be registered
+    // (e.g. the locked memory limit is too low), every read allocates.
+    // Throws std::system_error if io_uring is unavailable.
+    explicit UringFileReader(unsigned entries = 256, std::size_t buffers = 64,
+                             std::size_t bufferSize = 64 * 1024)
+    {
+      io_uring_params p;
+      std::memset(&p, 0, sizeof(p));
+      m_ring = static_cast<int>(::syscall(__NR_io_uring_setup, std::max(entries, 4u), &p));
+      if (m_ring < 0)
+        throw std::system_error(errno, std::system_category(), "io_uring_setup");
+
+      try
+      {
+        map(p);
+        probe();
+        m_wake = ::eventfd(0, EFD_CLOEXEC);
+        if (m_wake < 0)
+          throw std::system_error(errno, std::system_category(), "eventfd");
+        m_pool = std::make_shared<BufferPool>(buffers, bufferSize);
+        if (!m_pool->registerWith(m_ring))
+          m_pool = std::make_shared<BufferPool>(0, 0);
+      }
+      catch (...)
+      {
+        release();
+        throw;
+      }
+
+      m_thread = std::thread([this] { run(); });
+    }
+
+    UringFileReader(const UringFileReader&) = delete;
+    UringFileReader& operator=(const UringFileReader&) = delete;
+
+    ~UringFileReader() override
+    {
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_stop = true;
+      }
+      wake();
+      m_thread.join();
+      release();
+    }
+
+    void startRead(const std::string& path, std::uint64_t offset,
+                   std::size_t len, ContinuationT<FileResult> cont) override
+    {
+      const CancellationToken& t = currentCancellation();
+      if (t.isCancelled())
+        return;
+
+      auto r = allocateShared<Request>(path, offset, len, std::move(cont), t);
+      r->index = m_pool->acquire(len);
+      if (r->index >= 0)
+        r->data = m_pool->data(r->index);
+      else
+      {
+        r->heap.reset(new char[std::max<std::size_t>(len, 1)]);
+        r->data = r->heap.get();
+      }
+      r->pool = m_pool;
+      r->self = r;
+
+      bool wake = false;
+      int failed;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        failed = m_failed;
+        if (!failed)
+        {
+          m_incoming.push_back(r.get());
+          wake = m_idle;
+          m_idle = false;
+        }
+      }
+      if (failed)
+      {
+        r->self.reset();
+        ContinuationT<FileResult> c = std::move(r->cont);
+        return c(error(failed));
+      }
+      if (wake)
+        this->wake();
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    // The number of registered buffers (0 if they couldn't be registered)
+    std::size_t registeredBuffers() const { return m_pool->size(); }
+
+  private:
+    //--------------------------------------------------------------------------
+    // Registered buffers, shared by the reader and by the FileBuffers made
+    // from them
+    class BufferPool
+    {
+    public:
+      BufferPool(std::size_t n, std::size_t size)
+        : m_size(size)
+      {
+        if (n == 0 || size == 0)
+          return;
+        void* p = ::mmap(nullptr, n * size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+          return;
+        m_memory = static_cast<char*>(p);
+        for (std::size_t i = n; i > 0; --i)
+          m_free.push_back(static_cast<int>(i - 1));
+        m_count = n;
+      }
+
+      ~BufferPool()
+      {
+        if (m_memory)
+          ::munmap(m_memory, m_count * m_size);
+      }
+
+      BufferPool(const BufferPool&) = delete;
+      BufferPool& operator=(const BufferPool&) = delete;
+
+      bool registerWith(int ring)
+      {
+        if (m_count == 0)
+          return false;
+        std::vector<iovec> iov(m_count);
+        for (std::size_t i = 0; i < m_count; ++i)
+        {
+          iov[i].iov_base = data(static_cast<int>(i));
+          iov[i].iov_len = m_size;
+        }
+        return ::syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS,
+                         iov.data(), static_cast<unsigned>(m_count)) == 0;
+      }
+
+      // A free buffer's index, or -1 if none is free or len won't fit
+      int acquire(std::size_t len)
+      {
+        if (len > m_size)
+          return -1;
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (m_free.empty())
+          return -1;
+        int i = m_free.back();
+        m_free.pop_back();
+        return i;
+      }
+
+      void release(int i)
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_free.push_back(i);
+      }
+
+      char* data(int i) const { return m_memory + static_cast<std::size_t>(i) * m_size; }
+      std::size_t size() const { return m_count; }
+
+    private:
+      const std::size_t m_size;
+      char* m_memory = nullptr;
+      std::size_t m_count = 0;
+      std::mutex m_mutex;
+      std::vector<int> m_free;
+    };
+
+    //--------------------------------------------------------------------------
+    // A read in progress: it opens the file, reads into data, and closes it.
+    // It holds itself while the ring has it, and the FileBuffer it produces
+    // holds it after that.
+    struct Request
+    {
+      enum Stage { OPEN, READ };
+
+      Request(const std::string& p, std::uint64_t o, std::size_t n,
+              ContinuationT<FileResult>&& c, const CancellationToken& t)
+        : path(p), offset(o), len(n), cont(std::move(c)), token(t)
+      {}
+
+      ~Request()
+      {
+        if (index >= 0)
+          pool->release(index);
+      }
+
+      std::string path;
+      std::uint64_t offset;
+      std::size_t len;
+      ContinuationT<FileResult> cont;
+      CancellationToken token;
+
+      Stage stage = OPEN;
+      int fd = -1;
+      std::size_t done = 0;
+      char* data = nullptr;
+      int index = -1;                   // the registered buffer, if any
+      std::unique_ptr<char[]> heap;     // otherwise
+      std::shared_ptr<BufferPool> pool;
+      std::shared_ptr<Request> self;
+    };
+
+    // user_data for the operations which aren't a Request's
+    static const std::uint64_t s_wakeTag = 1;
+    static const std::uint64_t s_closeTag = 2;
+
+    //--------------------------------------------------------------------------
+    // Map the rings, as the kernel describes them in p
+    void map(const io_uring_params& p)
+    {
+      m_sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      m_cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+      const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if (single)
+        m_sqSize = m_cqSize = std::max(m_sqSize, m_cqSize);
+
+      m_sq = mapRing(m_sqSize, IORING_OFF_SQ_RING);
+      m_cq = single ? m_sq : mapRing(m_cqSize, IORING_OFF_CQ_RING);
+      m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+      m_sqes = static_cast<io_uring_sqe*>(mapRing(m_sqesSize, IORING_OFF_SQES));
+
+      char* sq = static_cast<char*>(m_sq);
+      m_sqHead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+      m_sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+      m_sqMask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+      m_sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+      m_sqEntries = p.sq_entries;
+
+      char* cq = static_cast<char*>(m_cq);
+      m_cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+      m_cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+      m_cqMask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+      m_cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+      m_localTail = *m_sqTail;
+    }
+
+    void* mapRing(std::size_t size, std::uint64_t offset)
+    {
+      void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       m_ring, static_cast<off_t>(offset));
+      if (p == MAP_FAILED)
+        throw std::system_error(errno, std::system_category(), "io_uring mmap");
+      return p;
+    }
+
+    // Check that the kernel has every operation we use
+    void probe()
+    {
+      const std::size_t ops = 256;
+      std::vector<char> buf(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op));
+      auto* pr = reinterpret_cast<io_uring_probe*>(buf.data());
+      if (::syscall(__NR_io_uring_register, m_ring, IORING_REGISTER_PROBE, pr, ops) < 0)
+        throw std::system_error(errno, std::system_category(), "io_uring probe");
+      for (int op : {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_CLOSE})
+        if (op > pr->last_op || !(pr->ops[op].flags & IO_URING_OP_SUPPORTED))
+          throw std::system_error(EOPNOTSUPP, std::system_category(), "io_uring probe");
+    }
+
+    void release()
+    {
+      if (m_sqes)
+        ::munmap(m_sqes, m_sqesSize);
+      if (m_cq && m_cq != m_sq)
+        ::munmap(m_cq, m_cqSize);
+      if (m_sq)
+        ::munmap(m_sq, m_sqSize);
+      if (m_wake >= 0)
+        ::close(m_wake);
+      ::close(m_ring);
+    }
+
+    void wake()
+    {
+      std::uint64_t one = 1;
+      ssize_t n = ::write(m_wake, &one, sizeof(one));
+      (void)n;
+    }
+
+    static std::uint64_t address(const void* p)
+    {
+      return static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(p));
+    }
+
+    //--------------------------------------------------------------------------
+    // Only the reader's thread touches the rings. Entries are published to the
+    // kernel all at once, just before they're submitted.
+    io_uring_sqe* next(std::uint64_t userData)
+    {
+      unsigned i = m_localTail++ & m_sqMask;
+      io_uring_sqe* sqe = &m_sqes[i];
+      std::memset(sqe, 0, sizeof(*sqe));
+      sqe->user_data = userData;
+      m_sqArray[i] = i;
+      ++m_inFlight;
+      return sqe;
+    }
+
+    void armWake()
+    {
+      io_uring_sqe* sqe = next(s_wakeTag);
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = m_wake;
+      sqe->addr = address(&m_wakeCount);
+      sqe->len = sizeof(m_wakeCount);
+      sqe->off = static_cast<std::uint64_t>(-1);
+    }
+
+    void open(Request* r)
+    {
+      m_started.insert(r);
+      io_uring_sqe* sqe = next(address(r));
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = address(r->path.c_str());
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+
+    void read(Request* r)
+    {
+      r->stage = Request::READ;
+      io_uring_sqe* sqe = next(address(r));
+      sqe->opcode = r->index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      sqe->fd = r->fd;
+      sqe->addr = address(r->data + r->done);
+      sqe->len = static_cast<unsigned>(std::min<std::size_t>(r->len - r->done, 1u << 30));
+      sqe->off = r->offset + r->done;
+      if (r->index >= 0)
+        sqe->buf_index = static_cast<std::uint16_t>(r->index);
+    }
+
+    void close(int fd)
+    {
+      io_uring_sqe* sqe = next(s_closeTag);
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = fd;
+    }
+
+    // Hand the result on, unless the read was cancelled
+    void finish(Request* r, FileResult result)
+    {
+      m_started.erase(r);
+      auto self = std::move(r->self);
+      ContinuationT<FileResult> c = std::move(r->cont);
+      if (!r->token.isCancelled())
+        c(std::move(result));
+    }
+
+    void complete(Request* r, int res)
+    {
+      if (r->stage == Request::OPEN)
+      {
+        if (res < 0)
+          return finish(r, error(-res));
+        r->fd = res;
+        if (r->len > 0 && !r->token.isCancelled())
+          return read(r);
+      }
+      else if (res == -EINTR || res == -EAGAIN)
+        return read(r);
+      else if (res > 0)
+      {
+        r->done += static_cast<std::size_t>(res);
+        if (r->done < r->len && !r->token.isCancelled())
+          return read(r);
+      }
+
+      close(r->fd);
+      if (res < 0)
+        return finish(r, error(-res));
+      std::shared_ptr<Request> owner = r->self;
+      finish(r, FileResult(FileBuffer(std::move(owner), r->data, r->done)));
+    }
+
+    // A Request has one operation in flight at a time (its close replaces
+    // its read, when it's done), and the wake read is one more. Starting a
+    // Request only when there's room for its operation keeps the rings from
+    // overflowing.
+    bool room() const
+    {
+      return m_inFlight + 1 < m_sqEntries;
+    }
+
+    void run()
+    {
+      std::vector<Request*> incoming;
+      std::vector<Request*> backlog;
+      std::size_t backlogStart = 0;
+      bool armed = false;
+      bool stopping = false;
+
+      for (;;)
+      {
+        {
+          std::lock_guard<std::mutex> g(m_mutex);
+          incoming.swap(m_incoming);
+          stopping = m_stop;
+          m_idle = !stopping;
+        }
+        backlog.insert(backlog.end(), incoming.begin(), incoming.end());
+        incoming.clear();
+
+        if (stopping)
+        {
+          // drop what hasn't started; wait for the kernel to finish the rest
+          for (std::size_t i = backlogStart; i < backlog.size(); ++i)
+            backlog[i]->self.reset();
+          backlog.clear();
+          backlogStart = 0;
+          if (m_inFlight == 0)
+            return;
+        }
+        else
+        {
+          if (!armed)
+          {
+            armWake();
+            armed = true;
+          }
+          while (backlogStart < backlog.size() && room())
+            open(backlog[backlogStart++]);
+          if (backlogStart == backlog.size())
+          {
+            backlog.clear();
+            backlogStart = 0;
+          }
+        }
+
+        // submit whatever is new, and wait for at least one completion
+        unsigned toSubmit = m_localTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        __atomic_store_n(m_sqTail, m_localTail, __ATOMIC_RELEASE);
+        int n = static_cast<int>(::syscall(__NR_io_uring_enter, m_ring, toSubmit, 1u,
+                                           IORING_ENTER_GETEVENTS, nullptr, 0));
+        if (n < 0 && errno != EINTR && errno != EBUSY)
+          return fail(errno, backlog, backlogStart);
+
+        unsigned head = *m_cqHead;
+        const unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+          const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+          const std::uint64_t userData = cqe.user_data;
+          const int res = cqe.res;
+          __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+          --m_inFlight;
+
+          if (userData == s_wakeTag)
+            armed = false;
+          else if (userData != s_closeTag)
+          {
+            Request* r = reinterpret_cast<Request*>(static_cast<std::uintptr_t>(userData));
+            if (stopping)
+            {
+              if (r->fd >= 0 && r->stage == Request::READ)
+                ::close(r->fd);
+              else if (r->stage == Request::OPEN && res >= 0)
+                ::close(res);
+              m_started.erase(r);
+              r->self.reset();
+            }
+            else
+              complete(r, res);
+          }
+        }
+      }
+    }
+
+    // The ring can't be used any more: fail the reads which haven't started,
+    // those which have, and (from now on) new ones. The kernel may still have
+    // the started ones' buffers, so they're kept until the reader is gone.
+    void fail(int e, const std::vector<Request*>& backlog, std::size_t backlogStart)
+    {
+      std::vector<Request*> incoming;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_failed = e;
+        incoming.swap(m_incoming);
+      }
+      for (std::size_t i = backlogStart; i < backlog.size(); ++i)
+        finish(backlog[i], error(e));
+      for (Request* r : incoming)
+        finish(r, error(e));
+
+      std::unordered_set<Request*> started;
+      started.swap(m_started);
+      for (Request* r : started)
+      {
+        if (r->stage == Request::READ)
+          ::close(r->fd);
+        m_abandoned.push_back(r->self);
+        finish(r, error(e));
+      }
+    }
+
+    int m_ring = -1;
+    int m_wake = -1;
+    std::uint64_t m_wakeCount = 0;
+
+    void* m_sq = nullptr;
+    void* m_cq = nullptr;
+    io_uring_sqe* m_sqes = nullptr;
+    std::size_t m_sqSize = 0;
+    std::size_t m_cqSize = 0;
+    std::size_t m_sqesSize = 0;
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+
+    // the reader thread's own
+    unsigned m_localTail = 0;
+    unsigned m_inFlight = 0;
+    std::unordered_set<Request*> m_started;   // opened, and not yet finished
+    std::vector<std::shared_ptr<Request>> m_abandoned;
+
+    std::shared_ptr<BufferPool> m_pool;
+
+    std::mutex m_mutex;
+    std::vector<Request*> m_incoming;
+    bool m_idle = false;   // the thread is (or is about to be) waiting
+    bool m_stop = false;
+    int m_failed = 0;      // the ring's error, once it has failed
+
+    std::thread m_thread;
+  };
+
+  //----------------------------------------------------------------------------
+  // An io_uring reader if io_uring works here, otherwise a pread one
+  inline std::unique_ptr<FileReader> makeFileReader()
+  {
+    try
+    {
+      return std::make_unique<UringFileReader>();
+    }
+    catch (const std::system_error&)
+    {
+      return std::make_unique<PreadFileReader>();
+    }
+  }
+}
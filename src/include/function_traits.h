@@ -1,15 +1,20 @@
 #pragma once
 
-#include <functional>
+#include <cstddef>
 #include <tuple>
 #include <type_traits>
+#include <utility>
 
 // For function objects (and lambdas), their function_traits are the
-// function_traits of their operator()
+// function_traits of their operator(), except that partially applying one
+// binds an argument to the object itself
 template <typename T>
 struct function_traits
   : public function_traits<decltype(&T::operator())>
-{};
+{
+  using appliedType =
+    typename function_traits<decltype(&T::operator())>::template Applied<T>;
+};
 
 // For a regular function, we destructure its type appropriately
 template <typename R, typename... A>
@@ -17,9 +22,9 @@ struct function_traits<R(A...)>
 {
   using returnType = R;
 
-  static const size_t arity = sizeof...(A);
+  static const std::size_t arity = sizeof...(A);
 
-  template <size_t n>
+  template <std::size_t n>
   struct Arg
   {
     using type = std::tuple_element_t<n, std::tuple<A...>>;
@@ -27,80 +32,87 @@ struct function_traits<R(A...)>
   };
 
   // Application calls the function
+  template <typename F>
+  using Applied = R;
   using appliedType = R;
 
   template <typename F>
   static inline auto apply(F&& f, A&&... args)
   {
-    return f(std::forward<A...>(args...));
+    return std::forward<F>(f)(std::forward<A>(args)...);
   }
 };
 
-// Specialization for 2 argument functions, to enable partial application
-template <typename R, typename A1, typename A2>
-struct function_traits<R(A1, A2)>
+// A function with its first argument bound, callable with the rest. It's a
+// concrete type holding the function and the argument inline, so currying
+// allocates nothing and the optimizer can see through it. Called as an rvalue
+// (as the combinators do), it moves the bound argument into the call;
+// otherwise it passes a copy.
+template <typename F, typename A1, typename R, typename... A>
+class Partial
 {
-  // decay the first arg so we can use a universal ref and not incur a copy
-  using A1B = std::decay_t<A1>;
-  using returnType = R;
-
-  static const size_t arity = 2;
-
-  template <size_t n>
-  struct Arg
+public:
+  template <typename G, typename B>
+  Partial(G&& g, B&& b)
+    : m_f(std::forward<G>(g))
+    , m_a1(std::forward<B>(b))
+  {}
+
+  R operator()(A... args) &&
   {
-    using type = std::tuple_element_t<n, std::tuple<A1, A2>>;
-    using bareType = std::decay_t<type>;
-  };
-
-  // (Partial) Application binds the first argument
-  using appliedType = std::function<R(A2)>;
+    return std::move(m_f)(std::move(m_a1), std::forward<A>(args)...);
+  }
 
-  template <typename F>
-  static inline auto apply(F&& f, A1B&& a1)
+  R operator()(A... args) const &
   {
-    // in case a1 is an rvalue ref, we need to capture "by forward" and make it
-    // mutable, to call the function with a move
-    return [f1 = std::forward<F>(f), a = std::forward<A1B>(a1)]
-      (A2&& a2) mutable -> R
-    {
-      return f1(std::move(a), std::forward<A2>(a2));
-    };
+    return m_f(m_a1, std::forward<A>(args)...);
   }
+
+private:
+  F m_f;
+  A1 m_a1;
 };
 
-// Specialization for 3+ argument functions, to enable partial application
+// Specialization for functions of 2 or more arguments, to enable partial
+// application
 template <typename R, typename A1, typename A2, typename... A>
 struct function_traits<R(A1, A2, A...)>
 {
-  // see decay note above
+  // decay the first arg so we can use a universal ref and not incur a copy
   using A1B = std::decay_t<A1>;
   using returnType = R;
 
-  static const size_t arity = 2 + sizeof...(A);
+  static const std::size_t arity = 2 + sizeof...(A);
 
-  template <size_t n>
+  template <std::size_t n>
   struct Arg
   {
     using type = std::tuple_element_t<n, std::tuple<A1, A2, A...>>;
     using bareType = std::decay_t<type>;
   };
 
-  // (Partial) Application binds the first argument
-  using appliedType = std::function<R(A2, A...)>;
+  // (Partial) Application binds the first argument, to a function of type F
+  template <typename F>
+  using Applied = Partial<std::decay_t<F>, A1B, R, A2, A...>;
+  using appliedType = Applied<R(*)(A1, A2, A...)>;
 
   template <typename F>
-  static inline auto apply(F&& f, A1B&& a1)
+  static inline Applied<F> apply(F&& f, A1B&& a1)
   {
-    // see capture-by-forward note above
-    return [f1 = std::forward<F>(f), a = std::forward<A1B>(a1)]
-      (A2&& a2, A&&... args) mutable -> R
-    {
-      return f1(std::move(a), std::forward<A2>(a2), std::forward<A...>(args...));
-    };
+    return Applied<F>(std::forward<F>(f), std::move(a1));
   }
 };
 
+// A Partial is a function of the remaining arguments. Its operator() is
+// overloaded, so it can't be found the usual way.
+template <typename F, typename A1, typename R, typename... A>
+struct function_traits<Partial<F, A1, R, A...>>
+  : public function_traits<R(A...)>
+{
+  using appliedType =
+    typename function_traits<R(A...)>::template Applied<Partial<F, A1, R, A...>>;
+};
+
 // For class member functions, extract the type
 template <typename C, typename R, typename... A>
 struct function_traits<R(C::*)(A...)>
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Compile-time instrumentation. Building with ASYNC_INSTRUMENT defined makes
+// the combinators count, per combinator type:
+//
+//  - allocations (and their payload bytes) of shared state, and of callables
+//    which don't fit a UniqueFunction's buffer
+//  - copies and moves of the closures they build, and of non-trivial Eithers
+//  - invocations of the continuations they pass on
+//
+// Without ASYNC_INSTRUMENT the probes expand to nothing, and the layout and
+// code of every combinator is unchanged. With it, each closure carries an
+// extra (empty) probe member, so sizes grow by up to a word.
+//
+// std::function's own allocations happen inside the standard library and
+// aren't counted; benchmark with ASYNC_USE_UNIQUE_FUNCTION to see them.
+//
+// Each thread counts into its own block of atomics (written only by that
+// thread, so an increment is a relaxed load and store). snapshot() adds up
+// every thread's block, plus the totals of threads which have exited:
+//
+//   auto before = async::instrument::snapshot();
+//   ...
+//   async::instrument::report(std::cout, async::instrument::snapshot() - before);
+
+namespace async
+{
+  namespace instrument
+  {
+#ifdef ASYNC_INSTRUMENT
+    constexpr bool enabled = true;
+#else
+    constexpr bool enabled = false;
+#endif
+
+    enum class Combinator : std::uint8_t
+    {
+      PURE,
+      FMAP,
+      APPLY,
+      BIND,
+      SEQUENCE,
+      RACE,
+      VIA,
+      WHEN_ALL,
+      WHEN_ANY,
+      FMAP_E,
+      BIND_E,
+      REPEAT_UNTIL,
+      FOR_EACH,
+      EITHER,
+      UNIQUE_FUNCTION,
+      COUNT
+    };
+
+    enum class Event : std::uint8_t
+    {
+      ALLOCATIONS,
+      BYTES,
+      COPIES,
+      MOVES,
+      INVOCATIONS,
+      COUNT
+    };
+
+    constexpr std::size_t s_combinators = static_cast<std::size_t>(Combinator::COUNT);
+    constexpr std::size_t s_events = static_cast<std::size_t>(Event::COUNT);
+
+    inline const char* name(Combinator c)
+    {
+      static const char* const names[s_combinators] = {
+        "pure", "fmap", "apply", "bind", "sequence", "race", "via",
+        "when_all", "when_any", "fmapE", "bindE", "repeat_until", "for_each",
+        "Either", "UniqueFunction" };
+      return names[static_cast<std::size_t>(c)];
+    }
+
+    inline const char* name(Event e)
+    {
+      static const char* const names[s_events] = {
+        "allocs", "bytes", "copies", "moves", "calls" };
+      return names[static_cast<std::size_t>(e)];
+    }
+
+    // A plain copy of the counters
+    class Snapshot
+    {
+    public:
+      std::uint64_t get(Combinator c, Event e) const
+      {
+        return m_counts[static_cast<std::size_t>(c)][static_cast<std::size_t>(e)];
+      }
+
+      std::uint64_t& at(std::size_t c, std::size_t e) { return m_counts[c][e]; }
+      std::uint64_t at(std::size_t c, std::size_t e) const { return m_counts[c][e]; }
+
+      // The total of one event over all combinators
+      std::uint64_t total(Event e) const
+      {
+        std::uint64_t n = 0;
+        for (std::size_t c = 0; c < s_combinators; ++c)
+          n += m_counts[c][static_cast<std::size_t>(e)];
+        return n;
+      }
+
+      Snapshot& operator+=(const Snapshot& other)
+      {
+        for (std::size_t c = 0; c < s_combinators; ++c)
+          for (std::size_t e = 0; e < s_events; ++e)
+            m_counts[c][e] += other.m_counts[c][e];
+        return *this;
+      }
+
+      Snapshot& operator-=(const Snapshot& other)
+      {
+        for (std::size_t c = 0; c < s_combinators; ++c)
+          for (std::size_t e = 0; e < s_events; ++e)
+            m_counts[c][e] -= other.m_counts[c][e];
+        return *this;
+      }
+
+      friend Snapshot operator-(Snapshot a, const Snapshot& b) { return a -= b; }
+
+    private:
+      std::array<std::array<std::uint64_t, s_events>, s_combinators> m_counts{};
+    };
+
+    // One thread's counters. Only the owning thread writes them.
+    class Counters
+    {
+    public:
+      Counters()
+      {
+        for (auto& c : m_counts)
+          for (auto& e : c)
+            e.store(0, std::memory_order_relaxed);
+      }
+
+      Counters(const Counters&) = delete;
+      Counters& operator=(const Counters&) = delete;
+
+      void add(Combinator c, Event e, std::uint64_t n)
+      {
+        auto& counter = m_counts[static_cast<std::size_t>(c)][static_cast<std::size_t>(e)];
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+      }
+
+      void addTo(Snapshot& s) const
+      {
+        for (std::size_t c = 0; c < s_combinators; ++c)
+          for (std::size_t e = 0; e < s_events; ++e)
+            s.at(c, e) += m_counts[c][e].load(std::memory_order_relaxed);
+      }
+
+    private:
+      std::array<std::array<std::atomic<std::uint64_t>, s_events>, s_combinators> m_counts;
+    };
+
+    // The live threads' counters, and the totals of those which have exited
+    class Registry
+    {
+    public:
+      static Registry& instance()
+      {
+        static Registry r;
+        return r;
+      }
+
+      void add(const Counters* c)
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_live.push_back(c);
+      }
+
+      void retire(const Counters* c)
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        c->addTo(m_retired);
+        for (auto& p : m_live)
+        {
+          if (p == c)
+          {
+            p = m_live.back();
+            m_live.pop_back();
+            break;
+          }
+        }
+      }
+
+      Snapshot snapshot()
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        Snapshot s = m_retired;
+        for (auto p : m_live)
+          p->addTo(s);
+        return s;
+      }
+
+    private:
+      std::mutex m_mutex;
+      std::vector<const Counters*> m_live;
+      Snapshot m_retired;
+    };
+
+    class ThreadCounters : public Counters
+    {
+    public:
+      // the registry is constructed first, so it outlives every thread's
+      // counters (including the main thread's)
+      ThreadCounters() : m_registry(Registry::instance()) { m_registry.add(this); }
+      ~ThreadCounters() { m_registry.retire(this); }
+
+    private:
+      Registry& m_registry;
+    };
+
+    inline Counters& threadCounters()
+    {
+      thread_local ThreadCounters counters;
+      return counters;
+    }
+
+    inline void count(Combinator c, Event e, std::uint64_t n = 1)
+    {
+      threadCounters().add(c, e, n);
+    }
+
+    inline void countAllocation(Combinator c, std::size_t bytes)
+    {
+      Counters& counters = threadCounters();
+      counters.add(c, Event::ALLOCATIONS, 1);
+      counters.add(c, Event::BYTES, bytes);
+    }
+
+    // The totals over all threads, past and present
+    inline Snapshot snapshot()
+    {
+      return Registry::instance().snapshot();
+    }
+
+    // The totals for the calling thread only
+    inline Snapshot threadSnapshot()
+    {
+      Snapshot s;
+      threadCounters().addTo(s);
+      return s;
+    }
+
+    // One row per combinator with anything counted
+    inline void report(std::ostream& os, const Snapshot& s)
+    {
+      os << "combinator     ";
+      for (std::size_t e = 0; e < s_events; ++e)
+      {
+        os.width(12);
+        os << name(static_cast<Event>(e));
+      }
+      os << '\n';
+
+      for (std::size_t c = 0; c < s_combinators; ++c)
+      {
+        bool any = false;
+        for (std::size_t e = 0; e < s_events; ++e)
+          any = any || s.at(c, e) != 0;
+        if (!any)
+          continue;
+
+        os.width(15);
+        os << std::left << name(static_cast<Combinator>(c)) << std::right;
+        for (std::size_t e = 0; e < s_events; ++e)
+        {
+          os.width(12);
+          os << s.at(c, e);
+        }
+        os << '\n';
+      }
+    }
+
+    inline void report(std::ostream& os)
+    {
+      report(os, snapshot());
+    }
+
+    // Counts the copies and moves of whatever holds it. It has no state, but
+    // it isn't trivially copyable, so closures holding it aren't either.
+    template <Combinator C>
+    struct Probe
+    {
+      Probe() = default;
+      Probe(const Probe&) { count(C, Event::COPIES); }
+      Probe(Probe&&) noexcept { count(C, Event::MOVES); }
+      Probe& operator=(const Probe&) { count(C, Event::COPIES); return *this; }
+      Probe& operator=(Probe&&) noexcept { count(C, Event::MOVES); return *this; }
+    };
+  }
+}
+
+// The probes placed in the combinators. ASYNC_PROBE goes at the start of a
+// lambda's capture list.
+#ifdef ASYNC_INSTRUMENT
+
+#define ASYNC_PROBE(c) \
+  probe_ = ::async::instrument::Probe<::async::instrument::Combinator::c>(),
+#define ASYNC_COUNT(c, e) \
+  ::async::instrument::count(::async::instrument::Combinator::c, \
+                             ::async::instrument::Event::e)
+#define ASYNC_COUNT_ALLOCATION(c, bytes) \
+  ::async::instrument::countAllocation(::async::instrument::Combinator::c, bytes)
+
+#else
+
+#define ASYNC_PROBE(c)
+#define ASYNC_COUNT(c, e) ((void)0)
+#define ASYNC_COUNT_ALLOCATION(c, bytes) ((void)0)
+
+#endif
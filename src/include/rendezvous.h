@@ -0,0 +1,73 @@
+#pragma once
+
+#include "function_traits.h"
+
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// A lock-free meeting point for the two sides of an applicative apply. Each
+// side constructs its value in place and then sets its bit in the state word;
+// whichever side sees the other's bit already set is the second to arrive, and
+// calls the continuation with the function applied to the argument. Nothing is
+// allocated after construction.
+
+template <typename F, typename A, typename C>
+class Rendezvous
+{
+public:
+  explicit Rendezvous(C&& c)
+    : m_cont(std::move(c))
+  {}
+
+  explicit Rendezvous(const C& c)
+    : m_cont(c)
+  {}
+
+  Rendezvous(const Rendezvous&) = delete;
+  Rendezvous& operator=(const Rendezvous&) = delete;
+
+  ~Rendezvous()
+  {
+    // the shared_ptr (or whatever owns us) orders this after both arrivals
+    unsigned char state = m_state.load(std::memory_order_relaxed);
+    if (state & HAVE_F)
+      f().~F();
+    if (state & HAVE_A)
+      a().~A();
+  }
+
+  template <typename FF>
+  void setF(FF&& ff)
+  {
+    new (&m_f) F(std::forward<FF>(ff));
+    if (m_state.fetch_or(HAVE_F, std::memory_order_acq_rel) & HAVE_A)
+      fire();
+  }
+
+  template <typename AA>
+  void setA(AA&& aa)
+  {
+    new (&m_a) A(std::forward<AA>(aa));
+    if (m_state.fetch_or(HAVE_A, std::memory_order_acq_rel) & HAVE_F)
+      fire();
+  }
+
+private:
+  enum : unsigned char { HAVE_F = 1, HAVE_A = 2 };
+
+  F& f() { return *reinterpret_cast<F*>(&m_f); }
+  A& a() { return *reinterpret_cast<A*>(&m_a); }
+
+  void fire()
+  {
+    m_cont(function_traits<F>::apply(std::move(f()), std::move(a())));
+  }
+
+  std::atomic<unsigned char> m_state{0};
+  std::aligned_storage_t<sizeof(F), alignof(F)> m_f;
+  std::aligned_storage_t<sizeof(A), alignof(A)> m_a;
+  C m_cont;
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "unique_function.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A work-stealing thread pool. Each worker has its own queue: tasks posted from
+// a worker go on that worker's queue (and it takes the most recent first, for
+// locality), tasks posted from elsewhere are spread round-robin, and an idle
+// worker steals the oldest task from the others before going to sleep.
+//
+// Any type with a post(UniqueFunction<void ()>) member can be used as an
+// executor with the async::via and async::schedule_on combinators.
+
+namespace async
+{
+  class ThreadPool
+  {
+  public:
+    using Task = UniqueFunction<void ()>;
+
+    explicit ThreadPool(std::size_t n = defaultSize())
+    {
+      n = std::max<std::size_t>(n, 1);
+      for (std::size_t i = 0; i < n; ++i)
+        m_queues.push_back(std::make_unique<Queue>());
+      for (std::size_t i = 0; i < n; ++i)
+        m_threads.emplace_back([this, i] { run(i); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Tasks already posted are run before the workers exit.
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> g(m_sleepMutex);
+        m_stop = true;
+      }
+      m_wake.notify_all();
+      for (auto& t : m_threads)
+        t.join();
+    }
+
+    void post(Task task)
+    {
+      std::size_t i = currentWorker() == this
+        ? currentIndex()
+        : m_next.fetch_add(1, std::memory_order_relaxed) % m_queues.size();
+      {
+        std::lock_guard<std::mutex> g(m_queues[i]->m);
+        m_queues[i]->tasks.push_back(std::move(task));
+      }
+      // sequentially consistent, pairing with the sleeper's increment and
+      // check below, so that a wakeup can't be lost
+      m_pending.fetch_add(1);
+      if (m_sleepers.load() > 0)
+      {
+        std::lock_guard<std::mutex> g(m_sleepMutex);
+        m_wake.notify_one();
+      }
+    }
+
+    std::size_t size() const { return m_threads.size(); }
+
+    // Whether the calling thread is one of this pool's workers
+    bool isWorker() const { return currentWorker() == this; }
+
+    static std::size_t defaultSize()
+    {
+      return std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    }
+
+  private:
+    struct Queue
+    {
+      std::mutex m;
+      std::deque<Task> tasks;
+    };
+
+    static const ThreadPool*& currentWorker()
+    {
+      static thread_local const ThreadPool* s_pool = nullptr;
+      return s_pool;
+    }
+
+    static std::size_t& currentIndex()
+    {
+      static thread_local std::size_t s_index = 0;
+      return s_index;
+    }
+
+    bool pop(std::size_t i, Task& task)
+    {
+      // our own queue first, newest task first
+      {
+        std::lock_guard<std::mutex> g(m_queues[i]->m);
+        if (!m_queues[i]->tasks.empty())
+        {
+          task = std::move(m_queues[i]->tasks.back());
+          m_queues[i]->tasks.pop_back();
+          return true;
+        }
+      }
+      // then steal, oldest task first
+      for (std::size_t n = 1; n < m_queues.size(); ++n)
+      {
+        Queue& q = *m_queues[(i + n) % m_queues.size()];
+        std::lock_guard<std::mutex> g(q.m);
+        if (!q.tasks.empty())
+        {
+          task = std::move(q.tasks.front());
+          q.tasks.pop_front();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void run(std::size_t i)
+    {
+      currentWorker() = this;
+      currentIndex() = i;
+
+      for (;;)
+      {
+        Task task;
+        if (pop(i, task))
+        {
+          m_pending.fetch_sub(1, std::memory_order_relaxed);
+          task();
+          continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_sleepers.fetch_add(1);
+        m_wake.wait(lock, [this] { return m_stop || m_pending.load() > 0; });
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+        if (m_stop && m_pending.load(std::memory_order_acquire) == 0)
+          return;
+      }
+    }
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::atomic<std::size_t> m_next{0};
+    std::atomic<std::size_t> m_pending{0};
+    std::atomic<int> m_sleepers{0};
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+  };
+}
@@ -0,0 +1,300 @@
+#pragma once
+
+#include "allocator.h"
+#include "unique_function.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// A hierarchical timer wheel, run by a single thread. Time is counted in ticks
+// (1ms by default). The wheel has s_levels levels of s_slots slots each: a
+// timer due within s_slots ticks goes in a slot of the first level, one due
+// within s_slots^2 ticks in a slot of the second, and so on. Each slot is an
+// intrusive list, so scheduling and cancelling a timer are O(1) however many
+// are pending. When the first level wraps around, the next level's current
+// slot is redistributed (cascaded) into the levels below it.
+//
+// Timers never fire early, and fire within a tick of their deadline unless the
+// thread is busy. Their callbacks run on the wheel's thread, outside its lock,
+// so they should be short: move longer work elsewhere with schedule_on. Timers
+// still pending when the wheel is destroyed never fire.
+//
+// While no timer is pending the thread sleeps; otherwise it wakes once a tick.
+// See async_timer.h for Asyncs which use it.
+
+namespace async
+{
+  class TimerWheel
+  {
+    class Timer;
+
+  public:
+    using Clock = std::chrono::steady_clock;
+    using Task = UniqueFunction<void ()>;
+
+    // Identifies a scheduled timer, to cancel it
+    using Handle = std::shared_ptr<Timer>;
+
+    static const std::size_t s_bits = 6;
+    static const std::size_t s_slots = std::size_t(1) << s_bits;
+    static const std::size_t s_levels = 4;
+
+    explicit TimerWheel(std::chrono::nanoseconds tick = std::chrono::milliseconds(1))
+      : m_tick(std::max(tick.count(), std::chrono::nanoseconds::rep(1)))
+      , m_start(Clock::now())
+    {
+      m_thread = std::thread([this] { run(); });
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    ~TimerWheel()
+    {
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        m_stop = true;
+      }
+      m_wake.notify_one();
+      m_thread.join();
+
+      // break each pending timer's hold on itself
+      for (auto& level : m_slots)
+        for (Timer*& head : level)
+          while (Timer* t = head)
+          {
+            unlink(t);
+            t->m_self.reset();
+          }
+    }
+
+    // Call f on the wheel's thread once d has elapsed.
+    template <typename Rep, typename Period>
+    Handle schedule(std::chrono::duration<Rep, Period> d, Task f)
+    {
+      auto t = allocateShared<Timer>(std::move(f));
+      const Clock::time_point now = Clock::now();
+
+      bool wake;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        // with nothing pending, the thread doesn't keep count of the ticks
+        if (m_count == 0)
+          m_now = std::max(m_now, tickAt(now));
+
+        t->m_expiry = std::max(tickAfter(now + d), m_now + 1);
+        t->m_self = t;
+        t->m_scheduled.store(true, std::memory_order_relaxed);
+        link(t.get());
+        ++m_count;
+        wake = m_idle;
+        m_idle = false;
+      }
+      if (wake)
+        m_wake.notify_one();
+      return t;
+    }
+
+    // Stop a timer from firing. Returns false if it already has (or it was
+    // already cancelled): in particular, when a timer's own callback cancels
+    // it, which takes no lock.
+    bool cancel(const Handle& h)
+    {
+      if (!h->m_scheduled.load(std::memory_order_acquire))
+        return false;
+
+      Task f;
+      Handle self;
+      {
+        std::lock_guard<std::mutex> g(m_mutex);
+        if (!h->m_scheduled.load(std::memory_order_relaxed))
+          return false;
+        h->m_scheduled.store(false, std::memory_order_relaxed);
+        unlink(h.get());
+        --m_count;
+        f = std::move(h->m_fire);
+        self = std::move(h->m_self);
+      }
+      return true;
+    }
+
+    // The number of timers scheduled but not yet fired or cancelled
+    std::size_t pending() const
+    {
+      std::lock_guard<std::mutex> g(m_mutex);
+      return m_count;
+    }
+
+    std::chrono::nanoseconds tick() const { return std::chrono::nanoseconds(m_tick); }
+
+  private:
+    class Timer
+    {
+    public:
+      explicit Timer(Task&& f) : m_fire(std::move(f)) {}
+
+    private:
+      friend class TimerWheel;
+
+      Timer* m_next = nullptr;
+      Timer** m_prev = nullptr;  // whatever points at this one
+      std::uint64_t m_expiry = 0;
+      Task m_fire;
+      Handle m_self;             // held while scheduled
+      std::atomic<bool> m_scheduled{false};
+    };
+
+    static const std::uint64_t s_mask = s_slots - 1;
+
+    // ticks since the start, rounded down and up
+    std::uint64_t tickAt(Clock::time_point t) const
+    {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t - m_start).count();
+      return ns <= 0 ? 0 : static_cast<std::uint64_t>(ns / m_tick);
+    }
+
+    std::uint64_t tickAfter(Clock::time_point t) const
+    {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t - m_start).count();
+      return ns <= 0 ? 0 : static_cast<std::uint64_t>((ns + m_tick - 1) / m_tick);
+    }
+
+    // Put a timer in the slot for its expiry, relative to now. A timer beyond
+    // the top level's range goes in its last slot, and is put back there
+    // when cascaded until it's in range.
+    void link(Timer* t)
+    {
+      std::uint64_t delta = t->m_expiry - m_now;
+      std::size_t level = 0;
+      while (level + 1 < s_levels && delta >= std::uint64_t(1) << (s_bits * (level + 1)))
+        ++level;
+
+      std::uint64_t e = t->m_expiry;
+      const std::uint64_t range = std::uint64_t(1) << (s_bits * s_levels);
+      if (delta >= range)
+        e = m_now + range - 1;
+
+      Timer*& head = m_slots[level][(e >> (s_bits * level)) & s_mask];
+      t->m_next = head;
+      t->m_prev = &head;
+      if (head)
+        head->m_prev = &t->m_next;
+      head = t;
+    }
+
+    static void unlink(Timer* t)
+    {
+      *t->m_prev = t->m_next;
+      if (t->m_next)
+        t->m_next->m_prev = t->m_prev;
+      t->m_next = nullptr;
+      t->m_prev = nullptr;
+    }
+
+    // Detach a slot's whole list
+    static Timer* take(Timer*& head)
+    {
+      Timer* t = head;
+      head = nullptr;
+      return t;
+    }
+
+    // Move one tick on: cascade any level whose slot boundary this is (from
+    // the top, so that a timer can fall through several levels at once), then
+    // take the callbacks of the timers due now.
+    void advance()
+    {
+      ++m_now;
+      for (std::size_t level = s_levels - 1; level > 0; --level)
+      {
+        if ((m_now & ((std::uint64_t(1) << (s_bits * level)) - 1)) != 0)
+          continue;
+        Timer* t = take(m_slots[level][(m_now >> (s_bits * level)) & s_mask]);
+        while (t)
+        {
+          Timer* next = t->m_next;
+          link(t);
+          t = next;
+        }
+      }
+
+      Timer* t = take(m_slots[0][m_now & s_mask]);
+      while (t)
+      {
+        Timer* next = t->m_next;
+        if (t->m_expiry > m_now)
+          link(t);
+        else
+        {
+          t->m_next = nullptr;
+          t->m_prev = nullptr;
+          t->m_scheduled.store(false, std::memory_order_release);
+          --m_count;
+          m_expired.push_back(std::move(t->m_fire));
+          t->m_self.reset();
+        }
+        t = next;
+      }
+    }
+
+    void run()
+    {
+      std::vector<Task> expired;
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (!m_stop)
+      {
+        if (m_count == 0)
+        {
+          m_idle = true;
+          m_wake.wait(lock);
+          m_idle = false;
+          continue;
+        }
+
+        const std::uint64_t target = tickAt(Clock::now());
+        if (m_now >= target)
+        {
+          m_wake.wait_until(lock, m_start + std::chrono::nanoseconds(m_tick * (m_now + 1)));
+          continue;
+        }
+        while (m_now < target && m_count > 0)
+          advance();
+        if (m_count == 0)
+          m_now = target;
+
+        if (m_expired.empty())
+          continue;
+        expired.swap(m_expired);
+        lock.unlock();
+        for (auto& f : expired)
+          f();
+        expired.clear();
+        lock.lock();
+      }
+    }
+
+    const std::chrono::nanoseconds::rep m_tick;
+    const Clock::time_point m_start;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    Timer* m_slots[s_levels][s_slots] = {};
+    std::uint64_t m_now = 0;
+    std::size_t m_count = 0;
+    std::vector<Task> m_expired;
+    bool m_idle = false;   // the thread is waiting for a timer
+    bool m_stop = false;
+
+    std::thread m_thread;
+  };
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "unique_function.h"
+
+#include <cstddef>
+#include <deque>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// A per-thread trampoline for synchronous completions. When every Async in a
+// chain completes synchronously, each bind step runs inside the previous
+// one's continuation, so the stack grows with the number of steps, and a
+// recursive loop of binds eventually overflows it.
+//
+// Inside a trampoline (see async::trampoline), bind and sequence count the
+// steps they call directly. Up to s_maxDepth steps nest as usual; the next one
+// is deferred instead, the stack unwinds, and the trampoline runs it from the
+// bottom. So the stack stays bounded however long the chain, and only one step
+// in s_maxDepth is queued (which may allocate).
+//
+// Outside a trampoline, steps are always called directly. Completions on
+// other threads are outside it too, so only synchronous work is affected.
+
+namespace async
+{
+  class Trampoline
+  {
+  public:
+    static const std::size_t s_maxDepth = 64;
+
+    static Trampoline& current()
+    {
+      thread_local Trampoline t;
+      return t;
+    }
+
+    bool active() const { return m_active; }
+
+    // Whether this thread's trampoline is active, without reaching for it
+    static bool activeHere() { return activeSlot(); }
+
+    // True if the next step should be deferred rather than called, because
+    // the trampoline is active and the stack is already deep
+    bool full() const { return m_active && m_depth == s_maxDepth; }
+
+    // Queue a step to run once the calls below it have returned
+    template <typename F>
+    void defer(F&& f)
+    {
+      m_queue.emplace_back(std::forward<F>(f));
+    }
+
+    // Marks a step which is called directly, for its lifetime
+    class Frame
+    {
+    public:
+      explicit Frame(Trampoline& t) : m_depth(t.m_depth) { ++m_depth; }
+      ~Frame() { --m_depth; }
+
+      Frame(const Frame&) = delete;
+      Frame& operator=(const Frame&) = delete;
+
+    private:
+      std::size_t& m_depth;
+    };
+
+    // Call f with the trampoline active, then run whatever was queued until
+    // nothing is left. Inside an active trampoline, just call f.
+    template <typename F>
+    void run(F&& f)
+    {
+      if (m_active)
+      {
+        f();
+        return;
+      }
+
+      ActiveGuard g(*this);
+      f();
+      while (!m_queue.empty())
+      {
+        UniqueFunction<void ()> next = std::move(m_queue.front());
+        m_queue.pop_front();
+        next();
+      }
+    }
+
+  private:
+    // Depth is counted from the start of the run. If a step throws, the rest
+    // of the queue is dropped.
+    class ActiveGuard
+    {
+    public:
+      explicit ActiveGuard(Trampoline& t)
+        : m_tramp(t)
+        , m_depth(t.m_depth)
+      {
+        m_tramp.m_active = true;
+        activeSlot() = true;
+        m_tramp.m_depth = 0;
+      }
+
+      ~ActiveGuard()
+      {
+        m_tramp.m_active = false;
+        activeSlot() = false;
+        m_tramp.m_depth = m_depth;
+        m_tramp.m_queue.clear();
+      }
+
+    private:
+      Trampoline& m_tramp;
+      std::size_t m_depth;
+    };
+
+    static bool& activeSlot()
+    {
+      static thread_local bool s_active = false;
+      return s_active;
+    }
+
+    bool m_active = false;
+    std::size_t m_depth = 0;
+    std::deque<UniqueFunction<void ()>> m_queue;
+  };
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include "allocator.h"
+#include "instrument.h"
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// A move-only type-erased callable with a configurable amount of inline
+// storage. Callables which fit in the buffer (and which can be moved without
+// throwing) are stored inline; anything else is placed on the heap. Unlike
+// std::function, the target does not need to be copyable.
+
+#ifndef UNIQUE_FUNCTION_DEFAULT_SIZE
+#define UNIQUE_FUNCTION_DEFAULT_SIZE (6 * sizeof(void*))
+#endif
+
+template <typename Sig, std::size_t Size = UNIQUE_FUNCTION_DEFAULT_SIZE>
+class UniqueFunction;
+
+template <typename R, typename... A, std::size_t Size>
+class UniqueFunction<R(A...), Size>
+{
+  static_assert(Size >= sizeof(void*),
+                "UniqueFunction storage must be able to hold a pointer");
+
+  using Storage = std::aligned_storage_t<Size, alignof(std::max_align_t)>;
+
+  // The operations on a stored callable: a hand-rolled vtable, one static
+  // instance per callable type.
+  struct Ops
+  {
+    R (*invoke)(void*, A&&...);
+    void (*move)(void* dst, void* src) noexcept;
+    void (*destroy)(void*) noexcept;
+  };
+
+  template <typename F>
+  struct IsLocal
+  {
+    static const bool value =
+      sizeof(F) <= Size
+      && alignof(std::max_align_t) % alignof(F) == 0
+      && std::is_nothrow_move_constructible<F>::value;
+  };
+
+  // Callables stored inside the buffer
+  template <typename F, bool Local = IsLocal<F>::value>
+  struct Model
+  {
+    static F* get(void* s) { return static_cast<F*>(s); }
+
+    template <typename G>
+    static void create(void* s, G&& g)
+    {
+      new (s) F(std::forward<G>(g));
+    }
+
+    static R invoke(void* s, A&&... args)
+    {
+      return (*get(s))(std::forward<A>(args)...);
+    }
+
+    static void move(void* dst, void* src) noexcept
+    {
+      new (dst) F(std::move(*get(src)));
+      get(src)->~F();
+    }
+
+    static void destroy(void* s) noexcept
+    {
+      get(s)->~F();
+    }
+
+    static const Ops s_ops;
+  };
+
+  // Callables stored on the heap, from the current MemoryResource (see
+  // allocator.h): the buffer holds a pointer to a box, which remembers the
+  // resource to free it to
+  template <typename F>
+  struct Model<F, false>
+  {
+    struct Box
+    {
+      template <typename G>
+      Box(async::MemoryResource& r, G&& g)
+        : resource(&r), f(std::forward<G>(g))
+      {}
+
+      async::MemoryResource* resource;
+      F f;
+    };
+
+    static Box*& get(void* s) { return *static_cast<Box**>(s); }
+
+    template <typename G>
+    static void create(void* s, G&& g)
+    {
+      async::MemoryResource& r = async::currentResource();
+      void* p = r.allocate(sizeof(Box), alignof(Box));
+      try
+      {
+        new (s) Box*(new (p) Box(r, std::forward<G>(g)));
+      }
+      catch (...)
+      {
+        r.deallocate(p, sizeof(Box), alignof(Box));
+        throw;
+      }
+      ASYNC_COUNT_ALLOCATION(UNIQUE_FUNCTION, sizeof(Box));
+    }
+
+    static R invoke(void* s, A&&... args)
+    {
+      return get(s)->f(std::forward<A>(args)...);
+    }
+
+    static void move(void* dst, void* src) noexcept
+    {
+      new (dst) Box*(get(src));
+    }
+
+    static void destroy(void* s) noexcept
+    {
+      Box* b = get(s);
+      async::MemoryResource* r = b->resource;
+      b->~Box();
+      r->deallocate(b, sizeof(Box), alignof(Box));
+    }
+
+    static const Ops s_ops;
+  };
+
+  // An empty UniqueFunction behaves like an empty std::function
+  struct Empty
+  {
+    static R invoke(void*, A&&...) { throw std::bad_function_call(); }
+    static void move(void*, void*) noexcept {}
+    static void destroy(void*) noexcept {}
+    static const Ops s_ops;
+  };
+
+  template <typename F>
+  static bool isNull(const F&) { return false; }
+
+  template <typename F>
+  static bool isNull(F* f) { return f == nullptr; }
+
+  template <typename S>
+  static bool isNull(const std::function<S>& f) { return !f; }
+
+public:
+  static const std::size_t size = Size;
+
+  UniqueFunction() noexcept
+    : m_ops(&Empty::s_ops)
+  {}
+
+  UniqueFunction(std::nullptr_t) noexcept
+    : m_ops(&Empty::s_ops)
+  {}
+
+  template <typename F, typename FD = std::decay_t<F>,
+            // constraint: don't hijack the move constructor
+            std::enable_if_t<!std::is_same<FD, UniqueFunction>::value, int> = 0>
+  UniqueFunction(F&& f)
+    : m_ops(&Empty::s_ops)
+  {
+    if (isNull(f))
+      return;
+    Model<FD>::create(&m_storage, std::forward<F>(f));
+    m_ops = &Model<FD>::s_ops;
+  }
+
+  UniqueFunction(UniqueFunction&& other) noexcept
+    : m_ops(other.m_ops)
+  {
+    m_ops->move(&m_storage, &other.m_storage);
+    other.m_ops = &Empty::s_ops;
+  }
+
+  UniqueFunction& operator=(UniqueFunction&& other) noexcept
+  {
+    if (this != &other)
+    {
+      m_ops->destroy(&m_storage);
+      m_ops = other.m_ops;
+      m_ops->move(&m_storage, &other.m_storage);
+      other.m_ops = &Empty::s_ops;
+    }
+    return *this;
+  }
+
+  UniqueFunction(const UniqueFunction&) = delete;
+  UniqueFunction& operator=(const UniqueFunction&) = delete;
+
+  ~UniqueFunction()
+  {
+    m_ops->destroy(&m_storage);
+  }
+
+  explicit operator bool() const noexcept
+  {
+    return m_ops != &Empty::s_ops;
+  }
+
+  // Like std::function, invocation is const but calls the target as non-const.
+  R operator()(A... args) const
+  {
+    return m_ops->invoke(&m_storage, std::forward<A>(args)...);
+  }
+
+  // Whether a callable of type F would be stored without allocating
+  template <typename F>
+  static constexpr bool storedInline()
+  {
+    return IsLocal<std::decay_t<F>>::value;
+  }
+
+private:
+  const Ops* m_ops;
+  mutable Storage m_storage;
+};
+
+template <typename R, typename... A, std::size_t Size>
+template <typename F, bool Local>
+const typename UniqueFunction<R(A...), Size>::Ops
+UniqueFunction<R(A...), Size>::Model<F, Local>::s_ops = {
+  &Model::invoke, &Model::move, &Model::destroy };
+
+template <typename R, typename... A, std::size_t Size>
+template <typename F>
+const typename UniqueFunction<R(A...), Size>::Ops
+UniqueFunction<R(A...), Size>::Model<F, false>::s_ops = {
+  &Model::invoke, &Model::move, &Model::destroy };
+
+template <typename R, typename... A, std::size_t Size>
+const typename UniqueFunction<R(A...), Size>::Ops
+UniqueFunction<R(A...), Size>::Empty::s_ops = {
+  &Empty::invoke, &Empty::move, &Empty::destroy };
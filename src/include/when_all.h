@@ -0,0 +1,384 @@
+#pragma once
+
+#include "async.h"
+
+#include <atomic>
+#include <cstddef>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// N-ary joins. when_all(aa...) waits for every Async and produces a tuple of
+// their results; when_any(aa...) produces the first result to arrive, together
+// with its index. Either way there is a single shared state (one allocation)
+// and a single atomic, however many Asyncs there are. As with && and ||,
+// Async<void> results become Void.
+//
+// when_all also takes a std::vector<Async<T>>, for fan-outs whose width is
+// only known at runtime, and produces a std::vector of the results in order.
+
+namespace async
+{
+  //----------------------------------------------------------------------------
+  // A minimal tagged union for when_any results: index() says which
+  // alternative is held, get<I>() retrieves it.
+  template <typename... Ts>
+  class OneOf
+  {
+  public:
+    template <std::size_t I, typename... Args>
+    OneOf(std::integral_constant<std::size_t, I>, Args&&... args)
+      : m_index(I)
+    {
+      new (&m_storage) Alternative<I>(std::forward<Args>(args)...);
+    }
+
+    OneOf(const OneOf& other)
+      : m_index(other.m_index)
+    {
+      s_copy[m_index](&m_storage, &other.m_storage);
+    }
+
+    OneOf(OneOf&& other)
+      : m_index(other.m_index)
+    {
+      s_move[m_index](&m_storage, &other.m_storage);
+    }
+
+    OneOf& operator=(const OneOf& other)
+    {
+      if (this != &other)
+      {
+        s_destroy[m_index](&m_storage);
+        m_index = other.m_index;
+        s_copy[m_index](&m_storage, &other.m_storage);
+      }
+      return *this;
+    }
+
+    OneOf& operator=(OneOf&& other)
+    {
+      if (this != &other)
+      {
+        s_destroy[m_index](&m_storage);
+        m_index = other.m_index;
+        s_move[m_index](&m_storage, &other.m_storage);
+      }
+      return *this;
+    }
+
+    ~OneOf()
+    {
+      s_destroy[m_index](&m_storage);
+    }
+
+    std::size_t index() const { return m_index; }
+
+    template <std::size_t I>
+    using Alternative = std::tuple_element_t<I, std::tuple<Ts...>>;
+
+    // Precondition: index() == I
+    template <std::size_t I>
+    Alternative<I>& get() { return *reinterpret_cast<Alternative<I>*>(&m_storage); }
+
+    template <std::size_t I>
+    const Alternative<I>& get() const { return *reinterpret_cast<const Alternative<I>*>(&m_storage); }
+
+  private:
+    template <typename T>
+    static void copyT(void* dst, const void* src) { new (dst) T(*static_cast<const T*>(src)); }
+
+    template <typename T>
+    static void moveT(void* dst, void* src) { new (dst) T(std::move(*static_cast<T*>(src))); }
+
+    template <typename T>
+    static void destroyT(void* p) { static_cast<T*>(p)->~T(); }
+
+    static constexpr void (*s_copy[])(void*, const void*) = { &copyT<Ts>... };
+    static constexpr void (*s_move[])(void*, void*) = { &moveT<Ts>... };
+    static constexpr void (*s_destroy[])(void*) = { &destroyT<Ts>... };
+
+    std::size_t m_index;
+    std::aligned_union_t<1, Ts...> m_storage;
+  };
+
+  template <typename... Ts>
+  constexpr void (*OneOf<Ts...>::s_copy[])(void*, const void*);
+
+  template <typename... Ts>
+  constexpr void (*OneOf<Ts...>::s_move[])(void*, void*);
+
+  template <typename... Ts>
+  constexpr void (*OneOf<Ts...>::s_destroy[])(void*);
+
+  //----------------------------------------------------------------------------
+  // The shared state for when_all: a slot per result and a countdown. The last
+  // result to arrive moves all the results into a tuple for the continuation.
+  template <typename C, typename... Ts>
+  class WhenAllData
+  {
+  public:
+    explicit WhenAllData(C&& c) : m_cont(std::move(c)) {}
+    explicit WhenAllData(const C& c) : m_cont(c) {}
+
+    WhenAllData(const WhenAllData&) = delete;
+    WhenAllData& operator=(const WhenAllData&) = delete;
+
+    ~WhenAllData()
+    {
+      destroy(std::index_sequence_for<Ts...>());
+    }
+
+    template <std::size_t I, typename... Args>
+    void set(Args&&... args)
+    {
+      new (&std::get<I>(m_slots)) Slot<I>(std::forward<Args>(args)...);
+      m_set[I] = true;
+      if (m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        fire(std::index_sequence_for<Ts...>());
+    }
+
+  private:
+    template <std::size_t I>
+    using Slot = std::tuple_element_t<I, std::tuple<Ts...>>;
+
+    template <std::size_t I>
+    Slot<I>& get() { return *reinterpret_cast<Slot<I>*>(&std::get<I>(m_slots)); }
+
+    template <std::size_t... Is>
+    void fire(std::index_sequence<Is...>)
+    {
+      m_cont(std::tuple<Ts...>(std::move(get<Is>())...));
+    }
+
+    template <std::size_t I>
+    int destroySlot()
+    {
+      using T = Slot<I>;
+      if (m_set[I])
+        get<I>().~T();
+      return 0;
+    }
+
+    template <std::size_t... Is>
+    void destroy(std::index_sequence<Is...>)
+    {
+      (void)std::initializer_list<int>{ destroySlot<Is>()... };
+    }
+
+    std::atomic<std::size_t> m_remaining{sizeof...(Ts)};
+    std::tuple<std::aligned_storage_t<sizeof(Ts), alignof(Ts)>...> m_slots;
+    bool m_set[sizeof...(Ts)] = {};
+    C m_cont;
+  };
+
+  template <std::size_t I, typename Data, typename AA>
+  inline void startWhenAll(const std::shared_ptr<Data>& pData, AA& aa)
+  {
+    aa([pData] (auto&&... a) {
+        ASYNC_COUNT(WHEN_ALL, INVOCATIONS);
+        pData->template set<I>(std::forward<decltype(a)>(a)...); });
+  }
+
+  template <typename... Ts, typename AS, std::size_t... Is>
+  inline Async<std::tuple<Ts...>> whenAllImpl(AS&& as, std::index_sequence<Is...>)
+  {
+    using C = ContinuationT<std::tuple<Ts...>>;
+
+    return [ASYNC_PROBE(WHEN_ALL) as1 = std::forward<AS>(as)] (C&& cont) mutable
+    {
+      auto pData = allocateShared<WhenAllData<C, Ts...>>(std::forward<C>(cont));
+      ASYNC_COUNT_ALLOCATION(WHEN_ALL, sizeof(WhenAllData<C, Ts...>));
+      (void)std::initializer_list<int>{
+        (startWhenAll<Is>(pData, std::get<Is>(as1)), 0)... };
+    };
+  }
+
+  // Run several Asyncs concurrently and collect all of their results.
+  template <typename... AA,
+            // constraint: each AA must be an Async
+            typename = std::tuple<FromAsyncT<AA>...>>
+  inline Async<std::tuple<IgnoreVoidT<FromAsyncT<AA>>...>> when_all(AA&&... aa)
+  {
+    static_assert(sizeof...(AA) > 0, "when_all needs at least one Async");
+    return whenAllImpl<IgnoreVoidT<FromAsyncT<AA>>...>(
+        std::make_tuple(std::forward<AA>(aa)...),
+        std::index_sequence_for<AA...>());
+  }
+
+  //----------------------------------------------------------------------------
+  // The shared state for the dynamic when_all, and a countdown. When results
+  // can be default-constructed and assigned, they are written in place into a
+  // vector sized up front, and the last to arrive hands it on.
+  //
+  // Otherwise they can't go straight into a vector, which can't hold a gap for
+  // a result that hasn't arrived. Each is constructed in its own slot as it
+  // arrives, and the last moves them all into a vector for the continuation:
+  // a second allocation and a move per result. (vector<bool> packs its
+  // elements, so bools can't be written concurrently and go into slots too.)
+  template <typename C, typename R,
+            bool = std::is_default_constructible<R>::value
+                   && std::is_move_assignable<R>::value
+                   && !std::is_same<R, bool>::value>
+  class WhenAllVectorData
+  {
+  public:
+    WhenAllVectorData(std::size_t n, C&& c)
+      : m_results(n), m_remaining(n), m_cont(std::move(c))
+    {}
+
+    WhenAllVectorData(const WhenAllVectorData&) = delete;
+    WhenAllVectorData& operator=(const WhenAllVectorData&) = delete;
+
+    // The bytes this allocates for n results
+    static std::size_t allocated(std::size_t n)
+    {
+      return sizeof(WhenAllVectorData) + n * sizeof(R);
+    }
+
+    template <typename... Args>
+    void set(std::size_t i, Args&&... args)
+    {
+      m_results[i] = R(std::forward<Args>(args)...);
+      if (m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        m_cont(std::move(m_results));
+    }
+
+  private:
+    std::vector<R> m_results;
+    std::atomic<std::size_t> m_remaining;
+    C m_cont;
+  };
+
+  template <typename C, typename R>
+  class WhenAllVectorData<C, R, false>
+  {
+  public:
+    WhenAllVectorData(std::size_t n, C&& c)
+      : m_slots(new Slot[n]), m_size(n), m_remaining(n), m_cont(std::move(c))
+    {}
+
+    WhenAllVectorData(const WhenAllVectorData&) = delete;
+    WhenAllVectorData& operator=(const WhenAllVectorData&) = delete;
+
+    ~WhenAllVectorData()
+    {
+      for (std::size_t i = 0; i < m_size; ++i)
+        if (m_slots[i].set)
+          get(i).~R();
+    }
+
+    // The bytes this allocates for n results, not counting the vector handed
+    // on
+    static std::size_t allocated(std::size_t n)
+    {
+      return sizeof(WhenAllVectorData) + n * sizeof(Slot);
+    }
+
+    template <typename... Args>
+    void set(std::size_t i, Args&&... args)
+    {
+      new (&m_slots[i].storage) R(std::forward<Args>(args)...);
+      m_slots[i].set = true;
+      if (m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        fire();
+    }
+
+  private:
+    struct Slot
+    {
+      std::aligned_storage_t<sizeof(R), alignof(R)> storage;
+      bool set = false;
+    };
+
+    R& get(std::size_t i) { return *reinterpret_cast<R*>(&m_slots[i].storage); }
+
+    void fire()
+    {
+      std::vector<R> results;
+      results.reserve(m_size);
+      for (std::size_t i = 0; i < m_size; ++i)
+        results.push_back(std::move(get(i)));
+      m_cont(std::move(results));
+    }
+
+    std::unique_ptr<Slot[]> m_slots;
+    std::size_t m_size;
+    std::atomic<std::size_t> m_remaining;
+    C m_cont;
+  };
+
+  // Run a runtime-sized collection of Asyncs concurrently and collect their
+  // results, in the same order.
+  template <typename AA,
+            // constraint: AA must be an Async<T>
+            typename T = FromAsyncT<AA>, typename R = IgnoreVoidT<T>>
+  inline Async<std::vector<R>> when_all(std::vector<AA> as)
+  {
+    using C = ContinuationT<std::vector<R>>;
+    using Data = WhenAllVectorData<C, R>;
+
+    return [ASYNC_PROBE(WHEN_ALL) as1 = std::move(as)] (C&& cont)
+    {
+      if (as1.empty())
+      {
+        cont(std::vector<R>());
+        return;
+      }
+
+      auto pData = allocateShared<Data>(as1.size(), std::forward<C>(cont));
+      ASYNC_COUNT_ALLOCATION(WHEN_ALL, Data::allocated(as1.size()));
+      for (std::size_t i = 0; i < as1.size(); ++i)
+        as1[i]([pData, i] (auto&&... a) {
+            ASYNC_COUNT(WHEN_ALL, INVOCATIONS);
+            pData->set(i, std::forward<decltype(a)>(a)...); });
+    };
+  }
+
+  //----------------------------------------------------------------------------
+  template <std::size_t I, typename R, typename Data, typename AA>
+  inline void startWhenAny(const std::shared_ptr<Data>& pData, AA& aa)
+  {
+    aa([pData] (auto&&... a) {
+        ASYNC_COUNT(WHEN_ANY, INVOCATIONS);
+        pData->finish([&] {
+            return R(std::integral_constant<std::size_t, I>(),
+                     std::forward<decltype(a)>(a)...); });
+      });
+  }
+
+  template <typename... Ts, typename AS, std::size_t... Is>
+  inline Async<OneOf<Ts...>> whenAnyImpl(AS&& as, std::index_sequence<Is...>)
+  {
+    using R = OneOf<Ts...>;
+    using C = ContinuationT<R>;
+
+    return [ASYNC_PROBE(WHEN_ANY) as1 = std::forward<AS>(as)] (C&& cont) mutable
+    {
+      // the same state as race: first to finish wins, and cancels the rest
+      auto pData = allocateShared<RaceData<C>>(std::forward<C>(cont));
+      ASYNC_COUNT_ALLOCATION(WHEN_ANY, sizeof(RaceData<C>));
+      CancellationScope scope(raceToken(pData));
+      (void)std::initializer_list<int>{
+        (startWhenAny<Is, R>(pData, std::get<Is>(as1)), 0)... };
+    };
+  }
+
+  // Run several Asyncs concurrently and take the first result, tagged with the
+  // index of the Async that produced it. The others are cancelled.
+  template <typename... AA,
+            // constraint: each AA must be an Async
+            typename = std::tuple<FromAsyncT<AA>...>>
+  inline Async<OneOf<IgnoreVoidT<FromAsyncT<AA>>...>> when_any(AA&&... aa)
+  {
+    static_assert(sizeof...(AA) > 0, "when_any needs at least one Async");
+    return whenAnyImpl<IgnoreVoidT<FromAsyncT<AA>>...>(
+        std::make_tuple(std::forward<AA>(aa)...),
+        std::index_sequence_for<AA...>());
+  }
+}